@@ -0,0 +1,156 @@
+/* Front end microbenchmark: lexer_create + lexer_simplify + parse_create
+ * (and releasing what they built) over a corpus of command lines, linked
+ * against the shell's own objects. Reports ns/op for each phase and the
+ * heap allocations per op, counted by interposing malloc. Built and run by
+ * `make bench`, the optional argument is the seconds spent per line. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include "../src/icshell.h"
+#include "../src/lexer.h"
+#include "../src/parse.h"
+#include "../src/arena.h"
+
+#define BENCH_SECONDS   0.5     /* per corpus line by default */
+#define BENCH_MIN_OPS   5
+
+gstate_t    gstate;     /* normally from icshell.c, which has main */
+
+/* glibc routes every allocation, its own included, through these */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static long allocs;
+
+void    *malloc(size_t size)
+{
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void    *calloc(size_t n, size_t size)
+{
+    allocs++;
+    return __libc_calloc(n, size);
+}
+
+void    *realloc(void *ptr, size_t size)
+{
+    allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+typedef struct
+{
+    char    *name;
+    char    *line;
+} corpus_t;
+
+static double   now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* n copies of word, separated by sep */
+static char *repeat(char *word, char *sep, int n)
+{
+    size_t  wlen, slen;
+    char    *line, *p;
+
+    wlen = strlen(word);
+    slen = strlen(sep);
+    line = malloc((wlen + slen) * n + 1);
+    assert(line);
+    p = line;
+    for (int i = 0; i < n; i++)
+    {
+        memcpy(p, word, wlen);
+        p += wlen;
+        if (i < n - 1)
+        {
+            memcpy(p, sep, slen);
+            p += slen;
+        }
+    }
+    *p = '\0';
+    return line;
+}
+
+static char *prefixed(char *prefix, char *rest)
+{
+    char    *line;
+
+    line = malloc(strlen(prefix) + strlen(rest) + 1);
+    assert(line);
+    strcpy(line, prefix);
+    strcat(line, rest);
+    free(rest);
+    return line;
+}
+
+/* Runs the line through the front end for about secs and prints a row */
+static void bench(corpus_t *c, double secs)
+{
+    lexlist_t       *lexlist;
+    parsenode_t     *tree;
+    arena_mark_t    mark;
+    double          t[5], phase[4], start;
+    long            ops, allocs_before;
+
+    memset(phase, 0, sizeof(phase));
+    allocs_before = allocs;
+    start = now();
+    for (ops = 0; ops < BENCH_MIN_OPS || now() - start < secs; ops++)
+    {
+        t[0] = now();
+        mark = arena_mark();
+        lexlist = lexer_create(c->line);
+        t[1] = now();
+        lexer_simplify(lexlist);
+        t[2] = now();
+        tree = parse_create(lexlist);
+        t[3] = now();
+        parsetree_close(tree);
+        arena_release(mark);
+        t[4] = now();
+        for (int i = 0; i < 4; i++)
+            phase[i] += t[i + 1] - t[i];
+    }
+    printf("%-16s %8zu %10ld %12.0f %12.0f %12.0f %12.0f %10.1f\n", c->name,
+           strlen(c->line), ops, phase[0] / ops * 1e9, phase[1] / ops * 1e9,
+           phase[2] / ops * 1e9, phase[3] / ops * 1e9,
+           (double)(allocs - allocs_before) / ops);
+}
+
+int main(int argc, char **argv)
+{
+    double      secs;
+    corpus_t    corpus[] = {
+        { "short", strdup("ls -la /tmp") },
+        { "mixed", strdup("echo $HOME \"a b\" 'c d' | grep -v x > out && "
+                          "cat < in >> log; wc -l &") },
+        { "args-10k", prefixed("echo ", repeat("argument", " ", 10000)) },
+        { "redir-args-10k", prefixed("cat > out ",
+                                     repeat("file", " ", 10000)) },
+        { "quoted", repeat("\"dq $USER 'sq'\"'sq \"dq\"'", "", 1000) },
+        { "pipeline-1k", repeat("cat -n", " | ", 1000) },
+        { "word-1m", prefixed("echo ", repeat("x", "", 1 << 20)) },
+        { "blanks-1m", prefixed("echo", repeat(" ", "\t", 1 << 19)) },
+    };
+
+    secs = (argc > 1) ? atof(argv[1]) : BENCH_SECONDS;
+    printf("%-16s %8s %10s %12s %12s %12s %12s %10s\n", "line", "bytes",
+           "ops", "lex ns/op", "simplify", "parse", "free", "allocs/op");
+    for (size_t i = 0; i < sizeof(corpus) / sizeof(*corpus); i++)
+    {
+        bench(&corpus[i], secs);
+        free(corpus[i].line);
+    }
+    return EXIT_SUCCESS;
+}
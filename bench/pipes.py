@@ -0,0 +1,78 @@
+# Pipeline throughput benchmark for the ICSH_PIPE_SIZE modes.
+# Runs tester/tests/pipes style workloads on a large copy of
+# tester/files/input and reports wall time, throughput and the context
+# switches of everything icshell started.
+import os
+import resource
+import sys
+import tempfile
+import time
+
+SHELL_PATH = os.path.join(os.path.dirname(__file__), "..", "icshell")
+INPUT_PATH = os.path.join(os.path.dirname(__file__), "..", "tester", "files", "input")
+INPUT_MB = int(os.environ.get("BENCH_INPUT_MB", "256"))
+RUNS = int(os.environ.get("BENCH_RUNS", "3"))
+MODES = ["", "max", "adaptive"]
+
+WORKLOADS = [
+    "cat {big} | grep nibh | wc -l",
+    "cat {big} | cat | cat | cat | wc -c",
+    "cat {big} | tr a-z A-Z | grep -v ZZZ | wc -l",
+]
+
+def make_input(directory):
+    with open(INPUT_PATH, "rb") as f:
+        chunk = f.read()
+    path = os.path.join(directory, "big")
+    with open(path, "wb") as f:
+        written = 0
+        block = chunk * max(1, (1 << 20) // len(chunk))
+        while written < INPUT_MB << 20:
+            f.write(block)
+            written += len(block)
+    return path, written
+
+def run(script, mode):
+    env = dict(os.environ)
+    env.pop("ICSH_PIPE_SIZE", None)
+    if mode:
+        env["ICSH_PIPE_SIZE"] = mode
+    before = resource.getrusage(resource.RUSAGE_CHILDREN)
+    start = time.perf_counter()
+    pid = os.fork()
+    if pid == 0:
+        devnull = os.open(os.devnull, os.O_WRONLY)
+        os.dup2(devnull, 1)
+        os.execve(SHELL_PATH, [SHELL_PATH, script], env)
+    os.waitpid(pid, 0)
+    wall = time.perf_counter() - start
+    after = resource.getrusage(resource.RUSAGE_CHILDREN)
+    vcsw = after.ru_nvcsw - before.ru_nvcsw
+    ivcsw = after.ru_nivcsw - before.ru_nivcsw
+    return wall, vcsw, ivcsw
+
+def main():
+    if not os.path.exists(SHELL_PATH):
+        sys.exit("build icshell first")
+    with tempfile.TemporaryDirectory() as tmp:
+        big, size = make_input(tmp)
+        script = os.path.join(tmp, "script")
+        print(f"{'workload':<44} {'mode':<9} {'wall s':>7} {'MB/s':>8} "
+              f"{'vol cs':>8} {'invol cs':>8}")
+        for workload in WORKLOADS:
+            line = workload.format(big=big)
+            with open(script, "w") as f:
+                f.write(line + "\n")
+            for mode in MODES:
+                best = None
+                for _ in range(RUNS):
+                    result = run(script, mode)
+                    if best is None or result[0] < best[0]:
+                        best = result
+                wall, vcsw, ivcsw = best
+                print(f"{workload.format(big='big'):<44} {mode or 'default':<9} "
+                      f"{wall:7.3f} {size / wall / (1 << 20):8.1f} "
+                      f"{vcsw:8d} {ivcsw:8d}")
+
+if __name__ == "__main__":
+    main()
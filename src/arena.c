@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "arena.h"
+
+#define ALIGN(n)    (((n) + _Alignof(max_align_t) - 1) \
+                     & ~(size_t)(_Alignof(max_align_t) - 1))
+
+static arena_block_t    *current;   /* the newest block */
+static arena_block_t    *spare;     /* the biggest block released so far,
+                                       up to ARENA_SPARE_MAX */
+static char             *last;      /* the newest allocation */
+
+/* Makes a block of at least size bytes the current one. The spare block
+ * is used if it is big enough, so a shell that runs one line after the
+ * other does not call malloc at all. */
+static void add_block(size_t size)
+{
+    arena_block_t   *block;
+
+    if (spare && spare->size >= size)
+    {
+        block = spare;
+        spare = NULL;
+    }
+    else
+    {
+        if (size < ARENA_BLOCK)
+            size = ARENA_BLOCK;
+        block = malloc(sizeof(*block) + size);
+        assert(block);
+        block->size = size;
+    }
+    block->used = 0;
+    block->prev = current;
+    current = block;
+}
+
+/* Aligned for anything, never NULL */
+void    *arena_alloc(size_t size)
+{
+    size = ALIGN(size);
+    if (!current || current->size - current->used < size)
+        add_block(size);
+    last = current->data + current->used;
+    current->used += size;
+    return last;
+}
+
+/* Like realloc, with the old size given. The newest allocation grows or
+ * shrinks in place if its block allows it, anything else is copied. */
+void    *arena_resize(void *ptr, size_t old, size_t size)
+{
+    size_t  off;
+    void    *new;
+
+    if (ptr && ptr == last)
+    {
+        off = last - current->data;
+        if (current->size - off >= ALIGN(size))
+        {
+            current->used = off + ALIGN(size);
+            return ptr;
+        }
+    }
+    new = arena_alloc(size);
+    if (ptr)
+        memcpy(new, ptr, old < size ? old : size);
+    return new;
+}
+
+char    *arena_strdup(char *s)
+{
+    size_t  len;
+
+    len = strlen(s) + 1;
+    return memcpy(arena_alloc(len), s, len);
+}
+
+arena_mark_t    arena_mark(void)
+{
+    arena_mark_t    mark;
+
+    mark.block = current;
+    mark.used = current ? current->used : 0;
+    return mark;
+}
+
+/* Gives back everything allocated since mark was taken. Marks nest, e.g.
+ * source releases each of its lines inside the line that ran it. Only
+ * lines that needed more than one block free anything. */
+void    arena_release(arena_mark_t mark)
+{
+    arena_block_t   *block;
+
+    while (current != mark.block)
+    {
+        block = current;
+        current = block->prev;
+        if (block->size <= ARENA_SPARE_MAX
+            && (!spare || block->size > spare->size))
+        {
+            free(spare);
+            spare = block;
+        }
+        else
+            free(block);
+    }
+    if (current)
+        current->used = mark.used;
+    last = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK     (64 * 1024)     /* smallest block, bigger on demand */
+#define ARENA_SPARE_MAX (1024 * 1024)   /* bigger blocks are not kept */
+
+/* The memory of the command line being run: its lexemes, its parse tree
+ * and the words its expansions produce. Everything is bump-allocated from
+ * blocks, and given back all at once by arena_release. */
+typedef struct arena_block_s
+{
+    struct arena_block_s    *prev;  /* the block before, NULL for the first */
+    size_t                  size;   /* bytes in data */
+    size_t                  used;
+    _Alignas(max_align_t) char  data[];
+} arena_block_t;
+
+/* what arena_release goes back to */
+typedef struct
+{
+    arena_block_t   *block;
+    size_t          used;
+} arena_mark_t;
+
+void            *arena_alloc(size_t);
+void            *arena_resize(void *, size_t, size_t);
+char            *arena_strdup(char *);
+arena_mark_t    arena_mark(void);
+void            arena_release(arena_mark_t);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     /* splice, copy_file_range */
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -6,24 +7,29 @@
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 #include "icshell.h"
 #include "lexer.h"
 #include "builtins.h"
 #include "parse.h"
+#include "hash.h"
+#include "jobs.h"
+#include "signals.h"
+#include "execution.h"
+#include "parallel.h"
+#include "trace.h"
+#include "source.h"
+#include "vars.h"
+#include "complete.h"
 
-static int invalid_syntax(lexeme_t *argv)
-{
-    if (argv && argv->type != WORD)
-    {
-        fprintf(stderr,
-            ICSHELL_NAME": syntax error in builtin: unexpected token `%s'\n",
-            argv->content);
-        gstate.exitstatus = EXITCODE(EXIT_INVALID_BUILTIN);
-        return 1;
-    }
-    return 0;
-}
+static char *builtin_names[] = {
+    "cd", "export", "unset", "exit", "hash", "type",
+    "jobs", "fg", "bg", "wait", "pwd", "echo", "env", "cat", "parallel",
+    "source", ".", "shift", NULL
+};
 
 void set_pwd(char *key)
 {
@@ -33,90 +39,89 @@ void set_pwd(char *key)
     if (!cwd)
         error_exit("cd: error retrieving current directory: getcwd",
                         EXIT_FAILURE);
-    setenv(key, cwd, 1);
+    vars_set(key, cwd, 1);
     free(cwd);
 }
 
-static void builtins_cd(lexeme_t *argv)
+static int  builtins_cd(char **argv)
 {
     char    *dir;
+    int     code;
 
-    if (invalid_syntax(argv))
-        return;
-    if (argv && argv->next)
+    if (argv[0] && argv[1])
     {
-        printerr_status("cd: too many arguments", EXIT_FAILURE);
-        return;
+        printerr("cd: too many arguments");
+        return EXIT_FAILURE;
     }
     /* 'cd' means 'cd $HOME' */
-    if (!argv || !strcmp(argv->content, "~"))
+    if (!argv[0] || !strcmp(argv[0], "~"))
     {
-        dir = getenv("HOME");
+        dir = vars_get("HOME");
         if (!dir || !*dir)
         {
-            printerr_status("cd: HOME not set", EXIT_FAILURE);
-            return;
+            printerr("cd: HOME not set");
+            return EXIT_FAILURE;
         }
     }
-    else if (!strcmp(argv->content, "-"))
+    else if (!strcmp(argv[0], "-"))
     {
-        dir = getenv("OLDPWD");
+        dir = vars_get("OLDPWD");
         if (!dir || !*dir)
         {
-            printerr_status("cd: OLDPWD not set", EXIT_FAILURE);
-            return;
+            printerr("cd: OLDPWD not set");
+            return EXIT_FAILURE;
         }
         fputs(dir, stdout);
         fputc('\n', stdout);
     }
     else
-        dir = argv->content;
+        dir = argv[0];
+    /* setting OLDPWD frees the value dir may point into */
+    dir = strdup(dir);
+    assert(dir);
     set_pwd("OLDPWD");
+    code = EXIT_SUCCESS;
     if (chdir(dir) == -1)
     {
         fprintf(stderr, ICSHELL_NAME": cd: %s: ", dir);
         perror(NULL);
-        gstate.exitstatus = EXITCODE(EXIT_FAILURE);
-        return;
+        code = EXIT_FAILURE;
     }
-    set_pwd("PWD");
-    gstate.exitstatus = EXITCODE(EXIT_SUCCESS);
+    else
+        set_pwd("PWD");
+    free(dir);
+    return code;
 }
 
-static void builtins_pwd(void)
+static int  builtins_pwd(void)
 {
     char    *cwd;
 
     cwd = getcwd(NULL, 0);
     if (!cwd)
     {
-        error_exit("pwd: error retrieving current directory: getcwd",
-                        EXIT_FAILURE);
+        printerr("pwd: error retrieving current directory: getcwd");
+        return EXIT_FAILURE;
     }
     fputs(cwd, stdout);
     fputc('\n', stdout);
     free(cwd);
-    exit(EXIT_SUCCESS);
+    return EXIT_SUCCESS;
 }
 
-static void builtins_env(char **argv)
+static int  builtins_env(char **argv)
 {
-    char    **p, *equals;
-
     if (*argv)
-        error_exit("env: too many arguments", EXIT_FAILURE);
-    for (p = environ; *p; p++)
     {
-        if (isdigit(**p))
-            continue;
-        equals = strchr(*p, '=');
-        if (equals && equals[1]) /* only print if the variable is set */
-        {
-            fputs(*p, stdout);
-            fputc('\n', stdout);
-        }
+        printerr("env: too many arguments");
+        return EXIT_FAILURE;
+    }
+    for (char **p = vars_environ(); *p; p++)
+    {
+        fputs(*p, stdout);
+        fputc('\n', stdout);
     }
-    exit(EXIT_SUCCESS);
+    return EXIT_SUCCESS;
 }
 
 static int n_flag(char *p)
@@ -134,7 +139,7 @@ static int n_flag(char *p)
     return 1;
 }
 
-static void builtins_echo(char **argv)
+static int  builtins_echo(char **argv)
 {
     int     done = 0; /* no more arguments */
     int     nflag = 0;
@@ -154,7 +159,105 @@ static void builtins_echo(char **argv)
     }
     if (!nflag)
         fputc('\n', stdout);
-    exit(EXIT_SUCCESS);
+    return EXIT_SUCCESS;
+}
+
+/* the zero-copy calls say this when they can't handle a pair of fds */
+static int copy_unsupported(void)
+{
+    return errno == EINVAL || errno == ENOSYS || errno == EXDEV
+        || errno == EOPNOTSUPP || errno == EBADF;
+}
+
+/* Copies in to out until EOF with the cheapest mechanism the two fds allow.
+ * All of them move the file offsets, so falling back halfway is fine.
+ * COPY_SAME_FILE if out is the regular file in with data left to read, as
+ * in `cat f >> f`, which would never reach EOF. */
+int copy_fd(int in, int out)
+{
+    struct stat ist, ost;
+    char        *buf;
+    ssize_t     n, w;
+
+    if (fstat(in, &ist) == -1 || fstat(out, &ost) == -1)
+        return -1;
+    if (S_ISREG(ost.st_mode) && ist.st_dev == ost.st_dev
+        && ist.st_ino == ost.st_ino && lseek(in, 0, SEEK_CUR) < ist.st_size)
+        return COPY_SAME_FILE;
+    if (S_ISREG(ist.st_mode) && S_ISREG(ost.st_mode))
+    {
+        while ((n = copy_file_range(in, NULL, out, NULL, CAT_CHUNK, 0)) > 0)
+            /* DO NOTHING */;
+        if (n == 0)
+            return 0;
+        if (!copy_unsupported())
+            return -1;
+    }
+    if (S_ISFIFO(ist.st_mode) || S_ISFIFO(ost.st_mode))
+    {
+        while ((n = splice(in, NULL, out, NULL, CAT_CHUNK, SPLICE_F_MOVE)) > 0)
+            /* DO NOTHING */;
+        if (n == 0)
+            return 0;
+        if (!copy_unsupported())
+            return -1;
+    }
+    if (S_ISREG(ist.st_mode))
+    {
+        while ((n = sendfile(out, in, NULL, CAT_CHUNK)) > 0)
+            /* DO NOTHING */;
+        if (n == 0)
+            return 0;
+        if (!copy_unsupported())
+            return -1;
+    }
+    buf = malloc(CAT_BUFSIZE);
+    assert(buf);
+    while ((n = read(in, buf, CAT_BUFSIZE)) > 0)
+    {
+        for (ssize_t off = 0; off < n; off += w)
+        {
+            if ((w = write(out, buf + off, n - off)) < 0)
+            {
+                free(buf);
+                return -1;
+            }
+        }
+    }
+    free(buf);
+    return (n < 0) ? -1 : 0;
+}
+
+static int  builtins_cat(char **argv)
+{
+    int     fd, n, exitstatus;
+    char    *name;
+
+    exitstatus = EXIT_SUCCESS;
+    fflush(stdout);
+    do
+    {
+        name = *argv ? *argv : "-";
+        if (!strcmp(name, "-"))
+            fd = STDIN_FILENO;
+        else if ((fd = open(name, O_RDONLY | O_CLOEXEC)) == -1)
+        {
+            fprintf(stderr, ICSHELL_NAME": cat: %s: %s\n", name,
+                strerror(errno));
+            exitstatus = EXIT_FAILURE;
+            continue;
+        }
+        if ((n = copy_fd(fd, STDOUT_FILENO)) != 0)
+        {
+            fprintf(stderr, ICSHELL_NAME": cat: %s: %s\n", name,
+                (n == COPY_SAME_FILE) ? "input file is output file"
+                : strerror(errno));
+            exitstatus = EXIT_FAILURE;
+        }
+        if (fd != STDIN_FILENO)
+            close(fd);
+    } while (*argv && *++argv);
+    return exitstatus;
 }
 
 static int  key_is_valid(char *key)
@@ -190,116 +293,71 @@ static char *parse_key(char *p, char **value)
     return res;
 }
 
-static int compare_strings(const void *s1, const void *s2)
-{
-    return strcmp(*(const char **)s1, *(const char **)s2);
-}
-
-static char **copy_environ(int len)
-{
-    char    **envp;
-    int     i;
-
-    if (!environ)
-    {
-        envp = malloc(sizeof(char *));
-        assert(envp);
-        *envp = NULL;
-        return envp;
-    }
-    envp = malloc(sizeof(char *) * (len + 1));
-    assert(envp);
-    for (i = 0; i < len; i++)
-        envp[i] = strdup(environ[i]);
-    envp[len] = NULL;
-    return envp;
-}
-
-
-static void builtins_export(lexeme_t *argv)
+static int  builtins_export(char **argv)
 {
-    char    *key, *value, **env, **environ_copy;
-    int     len, exitstatus;
+    char    *key, *value;
+    int     exitstatus;
 
     exitstatus = EXIT_SUCCESS;
-    if (!argv)
+    if (!*argv)
+        vars_print_exported();
+    for (; *argv; argv++)
     {
-        if (!environ)
-            return;
-        for (len = 0; environ[len]; len++)
-            /* DO NOTHING */;
-        environ_copy = copy_environ(len);
-        qsort(environ_copy, len, sizeof(*environ_copy), &compare_strings);
-        for (env = environ_copy; *env; env++)
+        key = parse_key(*argv, &value);
+        if (key_is_valid(key))
         {
-            key = parse_key(*env, &value);
-            if (!isdigit(*key))
+            if (value)
+                vars_set(key, value, 1);
+            else
+                vars_export(key);
+            if (!strcmp(key, "PATH"))
             {
-                if (!value || !*value)
-                    printf("declare -x %s\n", key);
-                else
-                    printf("declare -x %s=\"%s\"\n", key, value);
+                hash_clear();
+                complete_rehash();
             }
-            free(key);
-            free(*env);
         }
-        free(*env);
-        free(environ_copy);
-    }
-    while (argv)
-    {
-        if (invalid_syntax(argv))
-            return;
-        key = parse_key(argv->content, &value);
-        if (key_is_valid(key))
-            setenv(key, value ? value : "", 1);
         else
         {
             fprintf(stderr,
-                ICSHELL_NAME": export: `%s': not a valid identifier\n",
-                argv->content);
+                ICSHELL_NAME": export: `%s': not a valid identifier\n", *argv);
             exitstatus = EXIT_FAILURE;
         }
         free(key);
-        argv = argv->next;
     }
-    gstate.exitstatus = EXITCODE(exitstatus);
+    return exitstatus;
 }
 
-static void builtins_unset(lexeme_t *argv)
+static int  builtins_unset(char **argv)
 {
-    char    *content;
-
-    while (argv)
+    for (; *argv; argv++)
     {
-        if (invalid_syntax(argv))
-            return;
-        content = argv->content;
-        if (content && *content)
-            unsetenv(content);
-        argv = argv->next;
+        if (**argv)
+            vars_unset(*argv);
+        if (!strcmp(*argv, "PATH"))
+        {
+            hash_clear();
+            complete_rehash();
+        }
     }
-    gstate.exitstatus = EXITCODE(EXIT_SUCCESS);
+    return EXIT_SUCCESS;
 }
 
-static void builtins_exit(lexeme_t *argv)
+static int  builtins_exit(char **argv)
 {
     char        *endptr, *str;
     int64_t     code;
 
-    if (invalid_syntax(argv))
-        return;
     /* Some tests fail because of this but it is accurate bash behaviour
      * if done by hand and not with the tester. */
     fputs("exit\n", stderr);
-    if (argv)
+    if (*argv)
     {
-        if (argv->next)
+        if (argv[1])
         {
-            printerr_status("exit: too many arguments", EXIT_FAILURE);
-            return;
+            printerr("exit: too many arguments");
+            return EXIT_FAILURE;
         }
-        str = argv->content;
+        str = *argv;
         code = strtoll(str, &endptr, 10);
         if (*endptr == '\0'
             && !(( code == LLONG_MAX
@@ -312,44 +370,268 @@ static void builtins_exit(lexeme_t *argv)
             ICSHELL_NAME": exit: %s: numeric argument required\n", str);
         exit(EXIT_INVALID_BUILTIN);
     }
-    exit(WEXITSTATUS(gstate.exitstatus));
+    exit(status_code(gstate.exitstatus));
 }
 
-/* These builtins can be done in the fork because they do not
- * require modifying the internal state of the shell, i.e.
- * the environment or working directory. */
-void    builtins_infork(exec_t *exec)
+static int  builtins_hash(char **argv)
 {
-    char    *cmd;
+    int exitstatus;
 
-    if (!exec->argv)
-        return;
-    cmd = exec->argv[0];
-    if (!strcmp(cmd, "pwd"))
-        builtins_pwd();
-    else if (!strcmp(cmd, "echo"))
-        builtins_echo(exec->argv + 1);
-    else if (!strcmp(cmd, "env"))
-        builtins_env(exec->argv + 1);
+    exitstatus = EXIT_SUCCESS;
+    if (!*argv)
+        hash_print();
+    else if (!strcmp(*argv, "-r"))
+        hash_clear();
+    for (; *argv; argv++)
+    {
+        if (!strcmp(*argv, "-r") || builtins_is_builtin(*argv))
+            continue;
+        if (!hash_lookup(*argv))
+        {
+            fprintf(stderr, ICSHELL_NAME": hash: %s: not found\n", *argv);
+            exitstatus = EXIT_FAILURE;
+        }
+    }
+    return exitstatus;
 }
 
-/* Return 1 if it was a builtin otherwise 0 */
-int builtins_handle(lexeme_t *head)
+static int  builtins_type(char **argv)
 {
-    char    *cmd;
+    hashentry_t *entry;
+    char        *name, *path;
+    int         exitstatus;
 
-    if (head->type != WORD)
+    exitstatus = EXIT_SUCCESS;
+    for (; *argv; argv++)
+    {
+        name = *argv;
+        entry = hash_get(name);
+        if (builtins_is_builtin(name))
+            printf("%s is a shell builtin\n", name);
+        else if (entry)
+            printf("%s is hashed (%s)\n", name, entry->path);
+        else if (strchr(name, '/') && access(name, X_OK) == 0)
+            printf("%s is %s\n", name, name);
+        else if ((path = hash_lookup(name)) != NULL)
+            printf("%s is %s\n", name, path);
+        else
+        {
+            fprintf(stderr, ICSHELL_NAME": type: %s: not found\n", name);
+            exitstatus = EXIT_FAILURE;
+        }
+    }
+    return exitstatus;
+}
+
+static int  builtins_jobs(void)
+{
+    jobs_print();
+    return EXIT_SUCCESS;
+}
+
+/* fg and bg take at most one job spec, the current job by default */
+static job_t *find_job(char *name, char **argv)
+{
+    job_t   *job;
+
+    job = jobs_find(*argv);
+    if (!job)
+        fprintf(stderr, ICSHELL_NAME": %s: %s: no such job\n", name,
+            *argv ? *argv : "current");
+    return job;
+}
+
+static int  builtins_fg(char **argv)
+{
+    job_t   *job;
+
+    if ((job = find_job("fg", argv)) == NULL)
+        return EXIT_FAILURE;
+    printf("%s\n", job->text);
+    fflush(stdout);
+    job_foreground(job, 1);
+    job_finish(job);
+    signals_check_exit(gstate.exitstatus, 1);
+    return status_code(gstate.exitstatus);
+}
+
+static int  builtins_bg(char **argv)
+{
+    job_t   *job;
+
+    if ((job = find_job("bg", argv)) == NULL)
+        return EXIT_FAILURE;
+    job_background(job, 1);
+    return EXIT_SUCCESS;
+}
+
+/* wait [%n | pid]...: waits for every background job without arguments */
+static int  builtins_wait(char **argv)
+{
+    job_t   *job;
+    int     code;
+
+    code = EXIT_SUCCESS;
+    if (!*argv)
+        code = jobs_wait(NULL);
+    for (; *argv; argv++)
+    {
+        if ((job = jobs_find(*argv)) != NULL)
+            code = jobs_wait(job);
+        else
+        {
+            if (**argv == '%')
+                fprintf(stderr, ICSHELL_NAME": wait: %s: no such job\n",
+                    *argv);
+            else
+                fprintf(stderr, ICSHELL_NAME": wait: pid %s is not a child "
+                    "of this shell\n", *argv);
+            code = ERROR_NOT_FOUND;
+        }
+    }
+    return code;
+}
+
+/* shift [n]: drops the first n positional parameters, 1 by default */
+static int  builtins_shift(char **argv)
+{
+    char    *endptr;
+    long    n;
+
+    n = 1;
+    if (*argv)
+    {
+        if (argv[1])
+        {
+            printerr("shift: too many arguments");
+            return EXIT_FAILURE;
+        }
+        n = strtol(*argv, &endptr, 10);
+        if (!**argv || *endptr)
+        {
+            fprintf(stderr,
+                ICSHELL_NAME": shift: %s: numeric argument required\n", *argv);
+            return EXIT_FAILURE;
+        }
+        if (n < 0)
+        {
+            fprintf(stderr,
+                ICSHELL_NAME": shift: %s: shift count out of range\n", *argv);
+            return EXIT_FAILURE;
+        }
+    }
+    return vars_shift(n);
+}
+
+/* NULL-terminated, for completion */
+char    **builtins_names(void)
+{
+    return builtin_names;
+}
+
+int builtins_is_builtin(char *cmd)
+{
+    for (char **name = builtin_names; *name; name++)
+    {
+        if (!strcmp(*name, cmd))
+            return 1;
+    }
+    return 0;
+}
+
+/* Whether argv runs as a builtin. cat with options is left to the real one */
+int builtins_handles(char **argv)
+{
+    if (!strcmp(argv[0], "cat"))
+    {
+        while (*++argv)
+        {
+            if (**argv == '-' && (*argv)[1])
+                return 0;
+        }
+        return 1;
+    }
+    return builtins_is_builtin(argv[0]);
+}
+
+/* cat can block on the terminal (or a FIFO, or a device) for as long as the
+ * user likes, and the shell ignores SIGINT, so then it gets a child of its
+ * own (but never an exec). Regular files and a pipe on stdin it reads in the
+ * shell. in is its stdin, -1 for the shell's. */
+int builtins_needs_fork(char **argv, int in)
+{
+    struct stat st;
+    int         reads_stdin;
+
+    if (strcmp(*argv, "cat"))
+        return 0;
+    reads_stdin = !argv[1];
+    while (*++argv)
+    {
+        if (!strcmp(*argv, "-"))
+            reads_stdin = 1;
+        else if (stat(*argv, &st) == 0 && !S_ISREG(st.st_mode))
+            return 1;
+    }
+    if (!reads_stdin)
         return 0;
-    cmd = head->content;
+    if (fstat(in == -1 ? STDIN_FILENO : in, &st) == -1)
+        return 1;
+    return !S_ISREG(st.st_mode) && !S_ISFIFO(st.st_mode);
+}
+
+static int  dispatch(char **argv)
+{
+    char    *cmd;
+
+    cmd = *argv++;
     if (!strcmp(cmd, "cd"))
-        builtins_cd(head->next);
+        return builtins_cd(argv);
     else if (!strcmp(cmd, "export"))
-        builtins_export(head->next);
+        return builtins_export(argv);
     else if (!strcmp(cmd, "unset"))
-        builtins_unset(head->next);
+        return builtins_unset(argv);
     else if (!strcmp(cmd, "exit"))
-        builtins_exit(head->next);
-    else
-        return 0;
-    return 1;
+        return builtins_exit(argv);
+    else if (!strcmp(cmd, "hash"))
+        return builtins_hash(argv);
+    else if (!strcmp(cmd, "type"))
+        return builtins_type(argv);
+    else if (!strcmp(cmd, "jobs"))
+        return builtins_jobs();
+    else if (!strcmp(cmd, "fg"))
+        return builtins_fg(argv);
+    else if (!strcmp(cmd, "bg"))
+        return builtins_bg(argv);
+    else if (!strcmp(cmd, "wait"))
+        return builtins_wait(argv);
+    else if (!strcmp(cmd, "pwd"))
+        return builtins_pwd();
+    else if (!strcmp(cmd, "echo"))
+        return builtins_echo(argv);
+    else if (!strcmp(cmd, "env"))
+        return builtins_env(argv);
+    else if (!strcmp(cmd, "cat"))
+        return builtins_cat(argv);
+    else if (!strcmp(cmd, "parallel"))
+        return parallel_run(argv);
+    else if (!strcmp(cmd, "source") || !strcmp(cmd, "."))
+        return source_run(argv);
+    else if (!strcmp(cmd, "shift"))
+        return builtins_shift(argv);
+    return EXIT_FAILURE;
+}
+
+/* Runs any builtin and returns its exit code. The shell runs them itself
+ * unless they are part of a pipeline or a background job, where a change
+ * of directory or of the environment only affects the child, like in bash. */
+int builtins_run(char **argv)
+{
+    long long   start;
+    int         code;
+
+    start = trace_now();
+    code = dispatch(argv);
+    trace_span("builtin", start, argv[0]);
+    return code;
 }
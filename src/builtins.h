@@ -5,9 +5,16 @@
 #include "parse.h"
 
 #define EXIT_INVALID_BUILTIN    2
+#define CAT_CHUNK               (1 << 30)  /* per zero-copy call */
+#define CAT_BUFSIZE             (128 * 1024)
+#define COPY_SAME_FILE          -2  /* copy_fd: in would be read as it grows */
 
-int     builtins_handle(lexeme_t *);
-void    builtins_infork(exec_t *);
+int     builtins_run(char **);
 void    set_pwd(char *);
+int     builtins_is_builtin(char *);
+char    **builtins_names(void);
+int     builtins_handles(char **);
+int     builtins_needs_fork(char **, int);
+int     copy_fd(int, int);
 
 #endif
@@ -0,0 +1,317 @@
+#define _GNU_SOURCE     /* fstatat, O_DIRECTORY */
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <poll.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <readline/readline.h>
+#include "icshell.h"
+#include "builtins.h"
+#include "complete.h"
+#include "vars.h"
+
+/* Command names for tab completion. Scanning every PATH directory is too
+ * slow to do on each Tab (think NFS), so a thread builds a sorted index
+ * of them when the shell starts and builds it again whenever inotify says
+ * one of the directories changed, or PATH did. Tab only takes the lock
+ * to binary search the current index. */
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static cmdindex_t       *current;       /* NULL until the first build */
+static char             *pending_path;  /* PATH for the next build */
+static int              wake_fd = -1;   /* tells the thread PATH changed */
+static pid_t            owner;          /* forked children leave it alone */
+
+/* what the generator hands out to readline for the word being completed */
+static struct
+{
+    char    **names;
+    size_t  n;
+    size_t  next;
+}   matches;
+
+typedef struct
+{
+    cmdindex_t  *idx;
+    size_t      *offs;      /* of the names in pool until it stops moving */
+    size_t      cap;
+    size_t      poollen;
+    size_t      poolcap;
+}   builder_t;
+
+static void add_name(builder_t *b, char *name)
+{
+    size_t  len;
+
+    len = strlen(name) + 1;
+    if (b->idx->n == b->cap)
+    {
+        b->cap = b->cap ? b->cap * 2 : COMPLETE_NAMES_MIN;
+        b->offs = realloc(b->offs, sizeof(*b->offs) * b->cap);
+        assert(b->offs);
+    }
+    if (b->poollen + len > b->poolcap)
+    {
+        b->poolcap = (b->poollen + len) * 2;
+        b->idx->pool = realloc(b->idx->pool, b->poolcap);
+        assert(b->idx->pool);
+    }
+    memcpy(b->idx->pool + b->poollen, name, len);
+    b->offs[b->idx->n++] = b->poollen;
+    b->poollen += len;
+}
+
+/* The executable files of dir, not its subdirectories. The directory
+ * is watched before it is read so that nothing added meanwhile is missed. */
+static void scan_dir(builder_t *b, char *dir, int inotify_fd)
+{
+    struct dirent   *ent;
+    struct stat     st;
+    DIR             *dp;
+
+    if (inotify_fd != -1)
+        inotify_add_watch(inotify_fd, dir, IN_CREATE | IN_DELETE | IN_ATTRIB
+                          | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF
+                          | IN_MOVE_SELF | IN_ONLYDIR);
+    if ((dp = opendir(dir)) == NULL)
+        return;
+    while ((ent = readdir(dp)) != NULL)
+    {
+        if (ent->d_name[0] == '.' || ent->d_type == DT_DIR)
+            continue;
+        if (fstatat(dirfd(dp), ent->d_name, &st, 0) == 0
+            && S_ISREG(st.st_mode) && (st.st_mode & 0111))
+            add_name(b, ent->d_name);
+    }
+    closedir(dp);
+}
+
+static int  compare_names(const void *p1, const void *p2)
+{
+    return strcmp(*(char *const *)p1, *(char *const *)p2);
+}
+
+static cmdindex_t   *build(char *path, int inotify_fd)
+{
+    builder_t   b;
+    char        *dir, *end, sep;
+    size_t      n;
+
+    memset(&b, 0, sizeof(b));
+    b.idx = calloc(1, sizeof(*b.idx));
+    assert(b.idx);
+    for (char **name = builtins_names(); *name; name++)
+        add_name(&b, *name);
+    for (dir = path; *dir; dir = end + 1)
+    {
+        end = strchrnul(dir, ':');
+        sep = *end;
+        *end = '\0';
+        if (end != dir) /* the current directory is not worth an index */
+            scan_dir(&b, dir, inotify_fd);
+        *end = sep;
+        if (!sep)
+            break;
+    }
+    b.idx->names = malloc(sizeof(*b.idx->names) * (b.idx->n + 1));
+    assert(b.idx->names);
+    for (size_t i = 0; i < b.idx->n; i++)
+        b.idx->names[i] = b.idx->pool + b.offs[i];
+    free(b.offs);
+    qsort(b.idx->names, b.idx->n, sizeof(*b.idx->names), &compare_names);
+    n = 0;
+    for (size_t i = 0; i < b.idx->n; i++) /* in several PATH directories */
+    {
+        if (!n || strcmp(b.idx->names[i], b.idx->names[n - 1]))
+            b.idx->names[n++] = b.idx->names[i];
+    }
+    b.idx->n = n;
+    b.idx->names[n] = NULL;
+    return b.idx;
+}
+
+static void index_free(cmdindex_t *idx)
+{
+    if (!idx)
+        return;
+    free(idx->names);
+    free(idx->pool);
+    free(idx);
+}
+
+/* Blocks until a watched directory changed or PATH did. A burst of events
+ * (e.g. a package being installed) only leads to one rebuild. */
+static void wait_for_change(int inotify_fd)
+{
+    struct pollfd   fds[2];
+    char            buf[4096];
+    uint64_t        count;
+
+    fds[0] = (struct pollfd){ .fd = wake_fd, .events = POLLIN };
+    fds[1] = (struct pollfd){ .fd = inotify_fd, .events = POLLIN };
+    while (poll(fds, 1 + (inotify_fd != -1), -1) <= 0)
+        /* DO NOTHING */;
+    if (fds[0].revents & POLLIN)
+    {
+        read(wake_fd, &count, sizeof(count));
+        return;
+    }
+    do
+    {
+        while (read(inotify_fd, buf, sizeof(buf)) > 0)
+            /* DO NOTHING */;
+    }   while (poll(fds + 1, 1, COMPLETE_SETTLE_MS) > 0);
+}
+
+static void *indexer(void *arg)
+{
+    cmdindex_t  *idx, *old;
+    char        *path;
+    int         inotify_fd;
+
+    path = arg;
+    while (1)
+    {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        idx = build(path, inotify_fd);
+        pthread_mutex_lock(&lock);
+        old = current;
+        current = idx;
+        pthread_mutex_unlock(&lock);
+        index_free(old);
+        wait_for_change(inotify_fd);
+        if (inotify_fd != -1)
+            close(inotify_fd);
+        pthread_mutex_lock(&lock);
+        if (pending_path)
+        {
+            free(path);
+            path = pending_path;
+            pending_path = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+/* Whether the word starting at start is a command name rather than an
+ * argument: the first word of the line or of a pipeline stage or list */
+static int  command_position(int start)
+{
+    while (start > 0 && (rl_line_buffer[start - 1] == ' '
+                         || rl_line_buffer[start - 1] == '\t'))
+        start--;
+    return start == 0 || strchr("|;&", rl_line_buffer[start - 1]);
+}
+
+/* Copies the names that start with text out of the index, so that the lock
+ * is held for a binary search and a copy of the matches only */
+static void find_matches(const char *text)
+{
+    size_t  lo, hi, mid, len;
+
+    len = strlen(text);
+    matches.n = 0;
+    matches.next = 0;
+    pthread_mutex_lock(&lock);
+    if (!current)
+    {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    lo = 0;
+    hi = current->n;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (strncmp(current->names[mid], text, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (hi = lo; hi < current->n && !strncmp(current->names[hi], text, len);)
+        hi++;
+    matches.names = realloc(matches.names,
+                            sizeof(*matches.names) * (hi - lo + 1));
+    assert(matches.names);
+    for (size_t i = lo; i < hi; i++)
+    {
+        matches.names[matches.n] = strdup(current->names[i]);
+        assert(matches.names[matches.n]);
+        matches.n++;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* readline frees what it is given */
+static char *next_match(const char *text, int state)
+{
+    if (!state)
+        find_matches(text);
+    if (matches.next < matches.n)
+        return matches.names[matches.next++];
+    return NULL;
+}
+
+/* Command names come from the index, anything else (and paths) is left to
+ * readline's filename completion */
+static char **attempt_completion(const char *text, int start, int end)
+{
+    (void)end;
+    if (strchr(text, '/') || !command_position(start))
+        return NULL;
+    rl_attempted_completion_over = 1;
+    return rl_completion_matches(text, &next_match);
+}
+
+/* Starts the indexing thread with every signal blocked, so that they keep
+ * going to the shell itself */
+void    complete_init(void)
+{
+    pthread_t   thread;
+    sigset_t    all, old;
+    char        *path;
+
+    rl_attempted_completion_function = &attempt_completion;
+    owner = getpid();
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    path = strdup(vars_get("PATH") ? vars_get("PATH") : "");
+    assert(path);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (wake_fd != -1 && pthread_create(&thread, NULL, &indexer, path) == 0)
+        pthread_detach(thread);
+    else
+    {
+        free(path);
+        if (wake_fd != -1)
+            close(wake_fd);
+        wake_fd = -1;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* PATH changed, the index is built again from the new one */
+void    complete_rehash(void)
+{
+    uint64_t    one;
+    char        *path;
+
+    if (wake_fd == -1 || getpid() != owner)
+        return;
+    path = strdup(vars_get("PATH") ? vars_get("PATH") : "");
+    assert(path);
+    pthread_mutex_lock(&lock);
+    free(pending_path);
+    pending_path = path;
+    pthread_mutex_unlock(&lock);
+    one = 1;
+    write(wake_fd, &one, sizeof(one));
+}
@@ -0,0 +1,21 @@
+#ifndef COMPLETE_H
+#define COMPLETE_H
+
+#include <stddef.h>
+
+#define COMPLETE_SETTLE_MS  100 /* quiet time before a PATH dir is rescanned */
+#define COMPLETE_NAMES_MIN  1024
+
+/* Every command name that can be completed, sorted and without duplicates.
+ * The names are in one block of memory. */
+typedef struct
+{
+    char    **names;
+    size_t  n;
+    char    *pool;
+} cmdindex_t;
+
+void    complete_init(void);
+void    complete_rehash(void);
+
+#endif
@@ -1,12 +1,18 @@
+#define _GNU_SOURCE     /* pipe2 */
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
 #include <stdio.h>
+#include <dirent.h>
+#include <spawn.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <signal.h>
 #include "icshell.h"
 #include "lexer.h"
@@ -14,182 +20,720 @@
 #include "execution.h"
 #include "signals.h"
 #include "builtins.h"
+#include "hash.h"
+#include "pipes.h"
+#include "jobs.h"
+#include "trace.h"
+#include "arena.h"
+#include "vars.h"
+#include "glob.h"
 
-/* splits the paths on colon and returns a string of paths */
-static char **get_paths(void)
+/* returns the absolute path of cmd if it exists, otherwise prints the error,
+ * sets *status and returns NULL */
+static char *find_path(char *cmd, int *status)
 {
-    char *env_path, *p, **paths;
-    int count;
+    char    *full_path;
 
-    env_path = getenv("PATH");
-    if (!env_path)
-        return NULL;
-    /* duplicate so that we don't incorrectly modify the real env from strtok */
-    env_path = strdup(env_path);
-    assert(env_path);
-    count = (*env_path != '\0');
-    for (char *i = env_path; *i; i++)
+    if (!strncmp(cmd, "./", 2) || strchr(cmd, '/'))
+    {
+        if (access(cmd, F_OK) == 0)
+            return cmd;
+        perror_status(cmd, ERROR_NOT_FOUND);
+    }
+    else if ((full_path = hash_lookup(cmd)) != NULL)
+        return full_path;
+    else
     {
-        if (*i == ':')
-            count++;
+        fprintf(stderr, ICSHELL_NAME": %s: command not found\n", cmd);
+        gstate.exitstatus = EXITCODE(ERROR_NOT_FOUND);
     }
-    paths = malloc(sizeof(*paths) * (count + 1));
-    assert(paths);
-    paths[0] = strtok(env_path, ":");
-    for (count = 1; (p = strtok(NULL, ":")) != NULL; count++)
-        paths[count] = p;
-    paths[count] = NULL;
-    /* we will free paths[0] to free all the memory pointed to by
-     * the pointers in path (because of how strtok works) */
-    return paths;
+    *status = gstate.exitstatus;
+    return NULL;
 }
 
-/* returns the absolute path if it exists */
-static char *in_paths(char *cmd, char  **paths)
+static char *in_paths(char *cmd, int *status)
 {
-    char    *full_path;
-    int     cmd_len;
+    long long   start;
+    char        *path;
 
-    if (!cmd || !*cmd)
-        return NULL;
-    if (!strncmp(cmd, "./", 2) || strchr(cmd, '/'))
+    start = trace_now();
+    path = find_path(cmd, status);
+    trace_span("in_paths", start, cmd);
+    return path;
+}
+
+static int is_directory(char *path)
+{
+    struct stat statbuf;
+
+    return stat(path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode);
+}
+
+/* The file of a redirection, which has to be one word. A pattern is only
+ * replaced by a single match. */
+static char *expand_redir(char *word)
+{
+    wordlist_t  matches;
+    char        *file;
+
+    matches = (wordlist_t){ 0 };
+    if ((file = lexer_expand(word)) != NULL
+        && glob_expand(file, &matches) <= 1)
+        return matches.n ? matches.words[0] : file;
+    if (!file)
     {
-        if (access(cmd, F_OK) != 0)
-            perror_exit(cmd, ERROR_NOT_FOUND);
-        full_path = strdup(cmd);
-        assert(full_path);
-        return full_path;
+        file = arena_strdup(word);
+        lexer_unmark(file);
+    }
+    fprintf(stderr, ICSHELL_NAME": %s: ambiguous redirect\n", file);
+    return NULL;
+}
+
+/* Opens the redirections of a simple command from left to right like bash
+ * does, i.e. the innermost REDIR node first. The last redirection of each
+ * direction wins but every file is still opened (and created).
+ * fds[0] and fds[1] receive the new stdin and stdout, or stay untouched. */
+static int open_redirs(parsenode_t *node, int fds[3])
+{
+    redir_t *redir;
+    char    *file;
+    int     new_fd, *slot;
+
+    if (node->type != REDIR)
+        return 0;
+    redir = node->redir;
+    if (open_redirs(redir->cmd, fds) == -1)
+        return -1;
+    if (redir->type == HERE_DOC) /* the caller now owns the body's fd */
+    {
+        new_fd = redir->heredoc;
+        redir->heredoc = -1;
     }
-    cmd_len = strlen(cmd);
-    if (paths && *cmd != '.')
+    else
     {
-        for (int i = 0; paths[i]; i++)
+        if ((file = expand_redir(redir->file)) == NULL)
+            return -1;
+        new_fd = open(file, redir->mode | O_CLOEXEC, WR_PERMS);
+        if (new_fd == -1)
         {
-            full_path = malloc(strlen(paths[i]) + cmd_len + 2);
-            assert(full_path);
-            sprintf(full_path, "%s/%s", paths[i], cmd);
-            if (access(full_path, F_OK) == 0)
-                return full_path;
-            free(full_path);
+            perror_status(file, EXIT_FAILURE);
+            return -1;
         }
     }
-    return NULL;
+    slot = &fds[redir->fd == STDOUT_FILENO];
+    if (*slot != -1)
+        close(*slot);
+    *slot = new_fd;
+    return 0;
 }
 
-static void exit_if_directory(char *path)
+/* Returns argv with its expansions done, which is argv itself when there
+ * are none. Words that expand to nothing are dropped, patterns are
+ * replaced by the paths they match. Like the words, a new argv is in the
+ * arena. */
+static char **expand_argv(char **argv)
 {
-    struct stat statbuf;
+    wordlist_t  words;
+    char        *word;
+    int         i, n;
+
+    for (i = 0; argv[i]; i++)
+    {
+        if (strpbrk(argv[i], (char []){ EXP_BEGIN, EXP_KEEP, MARK_ESC,
+                                        GLOB_STAR, GLOB_ANY, GLOB_CLASS,
+                                        '\0' }))
+            break;
+    }
+    if (!argv[i])
+        return argv;
+    for (n = i; argv[n]; n++)
+        /* DO NOTHING */;
+    words.cap = n + 1;
+    words.words = arena_alloc(sizeof(*words.words) * words.cap);
+    words.n = 0;
+    for (i = 0; argv[i]; i++)
+    {
+        if ((word = lexer_expand(argv[i])) != NULL
+            && !glob_expand(word, &words))
+            wordlist_add(&words, word);
+    }
+    words.words[words.n] = NULL;
+    return words.words;
+}
+
+static exec_t *find_exec(parsenode_t *node)
+{
+    while (node->type == REDIR)
+        node = node->redir->cmd;
+    return node->exec;
+}
+
+/* Everything we open is close-on-exec. A forked builtin never execs, so it
+ * closes those fds itself to behave the same (e.g. for pipe EOFs). */
+static void close_cloexec(void)
+{
+    DIR             *dir;
+    struct dirent   *ent;
+    int             fd;
+
+    if (!(dir = opendir("/proc/self/fd")))
+        return;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        fd = atoi(ent->d_name);
+        if (fd > STDERR_FILENO && fd != dirfd(dir) && fd != trace_fileno()
+            && fd != jobs_fileno() && (fcntl(fd, F_GETFD) & FD_CLOEXEC))
+            close(fd);
+    }
+    closedir(dir);
+}
+
+/* With job control the child joins the job's process group itself too,
+ * since it might touch the terminal before the shell gets to setpgid */
+static pid_t fork_builtin(char **argv, int fds[3], job_t *job)
+{
+    pid_t   pid;
+
+    fflush(stdout); /* don't let the child print our buffer again */
+    pid = fork_and_check();
+    if (pid == 0) /* child process */
+    {
+        handle_signals(CHILD_MODE);
+        if (jobs_control())
+            setpgid(0, job->pgid);
+        else if (!job->foreground)
+        {
+            signal(SIGINT, SIG_IGN);
+            signal(SIGQUIT, SIG_IGN);
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            if (fds[i] != -1)
+                dup2(fds[i], i);
+        }
+        close_cloexec();
+        exit(builtins_run(argv));
+    }
+    return pid;
+}
+
+/* Runs a builtin inside the shell with fds[] temporarily dup'd over
+ * stdin/stdout/stderr. Returns its wait status. For the time keyword, what
+ * the shell used meanwhile counts as the builtin's, but for max RSS. */
+static int run_builtin(char **argv, int fds[3], job_t *job, int stage)
+{
+    struct rusage   before, after;
+    int             saved[3], status;
+
+    if (job->time)
+        getrusage(RUSAGE_SELF, &before);
+    fflush(stdout);
+    for (int i = 0; i < 3; i++)
+    {
+        saved[i] = -1;
+        if (fds[i] == -1)
+            continue;
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+        dup2(fds[i], i);
+    }
+    status = builtins_run(argv);
+    fflush(stdout);
+    clearerr(stdout); /* e.g. EPIPE must not stick to the next command */
+    for (int i = 0; i < 3; i++)
+    {
+        if (fds[i] == -1)
+            continue;
+        if (saved[i] == -1) /* it was closed before */
+            close(i);
+        else
+        {
+            dup2(saved[i], i);
+            close(saved[i]);
+        }
+    }
+    if (job->time)
+    {
+        getrusage(RUSAGE_SELF, &after);
+        timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+        timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+        after.ru_nvcsw -= before.ru_nvcsw;
+        after.ru_nivcsw -= before.ru_nivcsw;
+        after.ru_minflt -= before.ru_minflt;
+        after.ru_majflt -= before.ru_majflt;
+        after.ru_maxrss = -1; /* the shell's peak, not the builtin's */
+        job_usage(job, stage, &after);
+    }
+    return EXITCODE(status);
+}
 
-    if (stat(path, &statbuf) == -1)
-        perror_exit("stat", EXIT_FAILURE);
-    if (S_ISDIR(statbuf.st_mode)) /* if path is a directory */
+static void spawn_error(char *cmd, char *path, int err, int *status)
+{
+    if (is_directory(path))
     {
         fprintf(stderr, ICSHELL_NAME": %s: is a directory\n", path);
-        exit(ERROR_NOT_EXECUTABLE);
+        *status = EXITCODE(ERROR_NOT_EXECUTABLE);
+        return;
     }
+    errno = err;
+    if (err == EACCES)
+        perror_status(cmd, ERROR_NOT_EXECUTABLE);
+    else if (err == ENOENT)
+        perror_status(cmd, ERROR_NOT_FOUND);
+    else
+        perror_status(cmd, EXIT_FAILURE);
+    *status = gstate.exitstatus;
 }
 
-static void run_exec(exec_t *cmd)
+/* What execve needs room for: each string, its NUL and a pointer to it.
+ * *longest receives the longest string if not NULL. */
+static size_t args_size(char **args, size_t *longest)
 {
-    char **paths, *abs_path;
+    size_t  size, len;
 
-    if (!cmd || !cmd->argv)
-        exit(EXIT_SUCCESS);
-    builtins_infork(cmd);
-    paths = get_paths();
-    if ((abs_path = in_paths(cmd->argv[0], paths)) == NULL)
+    size = 0;
+    for (; *args; args++)
     {
-        fprintf(stderr, ICSHELL_NAME": %s: command not found\n", cmd->argv[0]);
-        exit(ERROR_NOT_FOUND);
+        len = strlen(*args) + 1;
+        if (longest && len > *longest)
+            *longest = len;
+        size += len + sizeof(char *);
     }
-    if (paths)
-        free(paths[0]); /* frees all of the strings in paths */
-    free(paths);
-    if (access(abs_path, X_OK) != 0)
-        perror_exit(cmd->argv[0], ERROR_NOT_EXECUTABLE);
-    execve(abs_path, cmd->argv, environ);
-    /* If execution is successful, this is never reached */
-    exit_if_directory(cmd->argv[0]);
-    perror_exit(cmd->argv[0], EXIT_FAILURE);
+    return size;
+}
+
+/* Checks argv and the environment against the limits of execve up front,
+ * since posix_spawn would only say E2BIG. Returns 0 after printing the
+ * error and setting *status if they do not fit. */
+static int  args_fit(char **argv, int *status)
+{
+    size_t  size, longest, strlen_max;
+    long    arg_max;
+
+    longest = 0;
+    size = args_size(argv, &longest) + args_size(vars_environ(), NULL);
+    arg_max = sysconf(_SC_ARG_MAX);
+    strlen_max = (size_t)sysconf(_SC_PAGESIZE) * ARG_STRLEN_PAGES;
+    if (arg_max > 0 && size > (size_t)arg_max)
+        fprintf(stderr, ICSHELL_NAME": %s: argument list too long (%zu bytes "
+                "with the environment, the limit is %ld)\n", argv[0], size,
+                arg_max);
+    else if (longest > strlen_max)
+        fprintf(stderr, ICSHELL_NAME": %s: argument too long (%zu bytes, the "
+                "limit is %zu)\n", argv[0], longest - 1, strlen_max - 1);
+    else
+        return 1;
+    gstate.exitstatus = EXITCODE(ERROR_NOT_EXECUTABLE);
+    *status = gstate.exitstatus;
+    return 0;
 }
 
-/* bit 0 of fd_track is for tracking in (< or <<) redirects
-   bit 1 of fd_track is for tracking out (> or >>) redirects */
-static void run_redir(redir_t *redir, int fd_track)
+/* posix_spawn can give signals their default back but cannot ignore them,
+ * and exec resets our handlers. So to start a command that ignores SIGINT
+ * and SIGQUIT, the shell ignores them itself around the spawn, with both
+ * blocked so that one arriving meanwhile still reaches our handler. */
+static void ignore_interrupts(int ignore)
 {
-    int new_fd, type;
+    static struct sigaction old_int, old_quit;
+    static sigset_t         old_mask;
+    struct sigaction        sa;
+    sigset_t                sigs;
 
-    if ((new_fd = open(redir->file, redir->mode, WR_PERMS)) == -1)
+    if (ignore)
     {
-        if (redir->cmd && redir->cmd->type == REDIR)
-            execute_node(redir->cmd, fd_track);
-        perror_exit(redir->file, EXIT_FAILURE);
+        sigemptyset(&sigs);
+        sigaddset(&sigs, SIGINT);
+        sigaddset(&sigs, SIGQUIT);
+        sigprocmask(SIG_BLOCK, &sigs, &old_mask);
+        sa.sa_handler = SIG_IGN;
+        sa.sa_flags = 0;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, &old_int);
+        sigaction(SIGQUIT, &sa, &old_quit);
     }
-    if (redir->type == HERE_DOC)
-        remove(redir->file); /* delete temporary heredoc file once done */
-    type = ((redir->type == REDIR_OUT) || (redir->type == REDIR_APP));
-    if (!(fd_track & (1 << type))) /* not duped yet */
+    else
     {
-        dup2(new_fd, redir->fd);
-        fd_track |= 1 << type;
+        sigaction(SIGINT, &old_int, NULL);
+        sigaction(SIGQUIT, &old_quit, NULL);
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
     }
+}
+
+/* posix_spawn uses clone(CLONE_VM | CLONE_VFORK) so the shell's memory is
+ * never copied. The child gets the redirections as file actions and the
+ * default signal dispositions back. Background jobs without job control
+ * ignore SIGINT and SIGQUIT like in bash, with job control every job gets
+ * a process group of its own instead. */
+static pid_t spawn_exec(char **argv, int fds[3], int *status, job_t *job)
+{
+    posix_spawn_file_actions_t  actions;
+    posix_spawnattr_t           attr;
+    sigset_t                    sigs;
+    char                        *path;
+    pid_t                       pid;
+    int                         err;
+    short                       flags;
+    long long                   start;
+    int                         detached;
+
+    if ((path = in_paths(argv[0], status)) == NULL || !args_fit(argv, status))
+        return -1;
+    posix_spawn_file_actions_init(&actions);
+    for (int i = 0; i < 3; i++)
+    {
+        if (fds[i] != -1)
+            posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+    }
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    detached = !job->foreground && !jobs_control();
+    if (!detached)
+    {
+        sigaddset(&sigs, SIGINT);
+        sigaddset(&sigs, SIGQUIT);
+    }
+    sigaddset(&sigs, SIGPIPE);
+    sigaddset(&sigs, SIGTSTP);
+    sigaddset(&sigs, SIGTTIN);
+    sigaddset(&sigs, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (jobs_control())
+    {
+        posix_spawnattr_setpgroup(&attr, job->pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+    if (detached)
+        ignore_interrupts(1);
+    start = trace_now();
+    err = posix_spawn(&pid, path, &actions, &attr, argv, vars_environ());
+    if (err == ENOENT && path != argv[0])
+    {
+        /* the hashed file went away, search PATH again like bash */
+        hash_forget(argv[0]);
+        if ((path = in_paths(argv[0], status)) != NULL)
+            err = posix_spawn(&pid, path, &actions, &attr, argv,
+                              vars_environ());
+    }
+    trace_span("execve", start, path);
+    if (detached)
+        ignore_interrupts(0);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err == 0)
+        return pid;
+    if (path)
+        spawn_error(argv[0], path, err, status);
+    return -1;
+}
+
+/* Starts the simple command cmd (an EXEC node, possibly under REDIR nodes)
+ * as stage i of job with in and out as its stdin and stdout, -1 meaning
+ * inherit. Does not wait. If no child was started the stage's pid is -1 and
+ * its status is the wait status the command "exited" with. Unless must_fork
+ * (pipelines and background jobs), builtins run in the shell. */
+static void launch_simple(job_t *job, int i, parsenode_t *cmd, int in,
+                          int out, int must_fork)
+{
+    exec_t  *exec;
+    char    **argv;
+    int     fds[3] = { in, out, -1 }, rfds[3] = { -1, -1, -1 }, *status;
+    pid_t   pid;
+
+    pid = -1;
+    status = &job->statuses[i];
+    *status = EXITCODE(EXIT_SUCCESS);
+    if (open_redirs(cmd, rfds) == -1)
+        *status = EXITCODE(EXIT_FAILURE);
     else
-        close(new_fd);
-    execute_node(redir->cmd, fd_track);
+    {
+        /* redirections take precedence over pipes */
+        if (rfds[0] != -1)
+            fds[0] = rfds[0];
+        if (rfds[1] != -1)
+            fds[1] = rfds[1];
+        exec = find_exec(cmd);
+        argv = exec->argv ? expand_argv(exec->argv) : NULL;
+        if (job->time && argv && *argv)
+        {
+            job->time->names[i] = strdup(argv[0]);
+            assert(job->time->names[i]);
+        }
+        if (argv && *argv && builtins_handles(argv))
+        {
+            if (must_fork || builtins_needs_fork(argv, fds[0]))
+                pid = fork_builtin(argv, fds, job);
+            else
+                *status = run_builtin(argv, fds, job, i);
+        }
+        else if (argv && *argv)
+            pid = spawn_exec(argv, fds, status, job);
+    }
+    for (int j = 0; j < 3; j++)
+    {
+        if (rfds[j] != -1)
+            close(rfds[j]);
+    }
+    job_started(job, i, pid);
+}
+
+/* Starts argv (already expanded) outside of any command line, for builtins
+ * like parallel that run commands themselves. fds[] replace stdin, stdout
+ * and stderr unless -1. Returns the pid, or -1 with *status set. */
+pid_t   execute_argv(char **argv, int fds[3], job_t *job, int *status)
+{
+    *status = EXITCODE(EXIT_SUCCESS);
+    if (builtins_handles(argv))
+        return fork_builtin(argv, fds, job);
+    return spawn_exec(argv, fds, status, job);
+}
+
+static int count_stages(parsenode_t *cmd)
+{
+    int n;
+
+    for (n = 1; cmd->type == PIPE; n++)
+        cmd = cmd->pipe->right;
+    return n;
 }
 
-static void run_pipe(pipe_t *cmd, int fd_track)
+/* Adaptive pipe mode: the shell keeps its own read end of every pipe (the
+ * job's arg) and looks at them while the stages run. A watched pipe is let
+ * go as soon as its reader is gone so the writer gets SIGPIPE. */
+static void watch_pipes(job_t *job)
 {
-    int     p[2], wstatus;
-    pid_t   left, right;
+    int *watch;
 
-    if (pipe(p) < 0)
-        perror_exit("pipe", EXIT_FAILURE);
-    handle_signals(INPIPE_MODE);
-    left = fork_and_check();
-    if (left == 0) /* child process */
+    watch = job->arg;
+    for (int i = 0; i < job->n - 1; i++)
     {
-        dup2(p[1], STDOUT_FILENO); /* replace stdout with write pipe end */
-        close(p[0]);
-        close(p[1]);
-        execute_node(cmd->left, fd_track);
+        if (watch[i] == -1)
+            continue;
+        if (job->pids[i + 1] <= 0)
+        {
+            close(watch[i]);
+            watch[i] = -1;
+        }
+        else
+            pipes_sample(watch[i]);
     }
-    right = fork_and_check();
-    if (right == 0) /* child process */
+}
+
+static void unwatch_pipes(job_t *job)
+{
+    int *watch;
+
+    watch = job->arg;
+    for (int i = 0; i < job->n - 1; i++)
     {
-        dup2(p[0], STDIN_FILENO); /* replace stdin with read pipe end */
-        close(p[0]);
-        close(p[1]);
-        execute_node(cmd->right, fd_track);
+        if (watch[i] != -1)
+            close(watch[i]);
     }
-    close(p[0]);
-    close(p[1]);
-    wstatus = 0; /* default wstatus */
-    waitpid(left, NULL, 0);      /* wait for left child to finish */
-    waitpid(right, &wstatus, 0); /* wait for right child to finish */
-    if (WIFSIGNALED(wstatus) && WTERMSIG(wstatus) != SIGPIPE)
+    free(watch);
+}
+
+/* Pipe stats mode: the shell sits in the middle of every pipe (see
+ * pipes_relay_pump), so it only moves data while it waits for the job */
+static void relay_pipes(job_t *job)
+{
+    pipes_relay_pump(job->arg, PIPE_SAMPLE_MS);
+}
+
+static void unrelay_pipes(job_t *job)
+{
+    pipes_relay_report(job->arg, job->text);
+    pipes_relay_free(job->arg);
+}
+
+/* Makes the pipes of a foreground job the way ICSH_PIPE_SIZE and
+ * ICSH_PIPE_STATS want them, pipe2() for a plain one */
+static int make_pipe(job_t *job, int i, int fds[2])
+{
+    int *watch;
+
+    if (job->tick == &relay_pipes)
+        return pipes_relay_add(job->arg, i, fds);
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return -1;
+    pipes_setup(fds[0]);
+    if (job->tick == &watch_pipes)
+    {
+        watch = job->arg;
+        watch[i] = fcntl(fds[0], F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+    }
+    return 0;
+}
+
+/* Only a foreground pipeline is looked after by the shell while it runs */
+static void setup_pipes(job_t *job, int background)
+{
+    int *watch;
+
+    if (background || job->n < 2)
+        return;
+    if (pipes_stats())
+    {
+        job->arg = pipes_relay_new(job->n - 1);
+        job->tick = &relay_pipes;
+        job->tick_ms = 0; /* it waits in poll() itself */
+        job->release = &unrelay_pipes;
+    }
+    else if (pipes_mode() == PIPESZ_ADAPTIVE)
     {
-        signals_check_exit(wstatus, 0); /* no extra newline */
-        /* bash defines signal exitcodes as starting from 128 */
-        exit(WTERMSIG(wstatus) + 128);
+        watch = malloc(sizeof(*watch) * (job->n - 1));
+        assert(watch);
+        for (int i = 0; i < job->n - 1; i++)
+            watch[i] = -1;
+        job->arg = watch;
+        job->tick = &watch_pipes;
+        job->tick_ms = PIPE_SAMPLE_MS;
+        job->release = &unwatch_pipes;
     }
-    exit(WEXITSTATUS(wstatus));
 }
 
-void execute_node(parsenode_t *cmd, int fd_track)
+/* Launches every stage of a PIPE chain directly from the shell, so there
+ * are exactly n children for n stages, as one job. A foreground job is
+ * waited for and its status is the status of the last stage. Without job
+ * control a background job reads from /dev/null unless redirected. */
+static void run_job(parsenode_t *cmd, int background, int timed)
+{
+    parsenode_t *node;
+    job_t       *job;
+    int         (*pipes)[2], n, i, in, out;
+
+    n = count_stages(cmd);
+    job = job_new(cmd, n, !background);
+    if (timed)
+        job_timed(job);
+    setup_pipes(job, background);
+    pipes = malloc(sizeof(*pipes) * (n - 1));
+    assert(pipes);
+    for (i = 0; i < n - 1; i++)
+    {
+        if (make_pipe(job, i, pipes[i]) < 0)
+        {
+            perror_status("pipe", EXIT_FAILURE);
+            while (i--)
+            {
+                close(pipes[i][0]);
+                close(pipes[i][1]);
+            }
+            if (job->release == &unrelay_pipes) /* nothing to report */
+            {
+                job->release = NULL;
+                pipes_relay_free(job->arg);
+            }
+            job_free(job);
+            free(pipes);
+            return;
+        }
+    }
+    node = cmd;
+    for (i = 0; i < n; i++)
+    {
+        in = (i > 0) ? pipes[i - 1][0] : -1;
+        out = (i < n - 1) ? pipes[i][1] : -1;
+        if (i == 0 && background && !jobs_control())
+            in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        launch_simple(job, i, node->type == PIPE ? node->pipe->left : node,
+                      in, out, n > 1 || background);
+        /* our copies must go, otherwise readers never see EOF */
+        if (in != -1)
+            close(in);
+        if (out != -1)
+            close(out);
+        if (node->type == PIPE)
+            node = node->pipe->right;
+    }
+    free(pipes);
+    if (background)
+    {
+        job_background(job, 0);
+        return;
+    }
+    job_foreground(job, 0);
+    job_finish(job);
+    signals_check_exit(gstate.exitstatus, 1); /* print newline as well */
+}
+
+/* A background list (a && b &) runs in a forked copy of the shell, which
+ * is a job of one stage */
+static void run_subshell(parsenode_t *cmd)
+{
+    job_t   *job;
+    pid_t   pid;
+    int     fd;
+
+    job = job_new(cmd, 1, 0);
+    fflush(stdout);
+    pid = fork_and_check();
+    if (pid == 0) /* child process */
+    {
+        handle_signals(CHILD_MODE);
+        if (jobs_control())
+            setpgid(0, 0);
+        else
+        {
+            signal(SIGINT, SIG_IGN);
+            signal(SIGQUIT, SIG_IGN);
+            if ((fd = open("/dev/null", O_RDONLY)) != -1)
+            {
+                dup2(fd, STDIN_FILENO);
+                close(fd);
+            }
+        }
+        jobs_forked();
+        execute_node(cmd);
+        exit(status_code(gstate.exitstatus));
+    }
+    job_started(job, 0, pid);
+    job_background(job, 0);
+}
+
+/* An interrupted command stops the rest of the list, or of a sourced
+ * script, like in bash */
+int execute_interrupted(void)
+{
+    return WIFSIGNALED(gstate.exitstatus)
+        && WTERMSIG(gstate.exitstatus) == SIGINT;
+}
+
+/* Runs the tree from the parent shell and sets gstate.exitstatus. Lists
+ * are walked right here, only their commands start children. */
+void execute_node(parsenode_t *cmd)
 {
     switch (cmd->type)
     {
         case EXEC:
-            run_exec(cmd->exec);
-            break;
         case REDIR:
-            run_redir(cmd->redir, fd_track);
-            break;
         case PIPE:
-            run_pipe(cmd->pipe, fd_track);
+            run_job(cmd, 0, 0);
+            break;
+        case TIME:
+            run_job(cmd->timed, 0, 1);
+            break;
+        case ASYNC:
+            if (cmd->async->type == EXEC || cmd->async->type == REDIR
+                || cmd->async->type == PIPE)
+                run_job(cmd->async, 1, 0);
+            else
+                run_subshell(cmd->async);
+            break;
+        case LIST:
+            execute_node(cmd->list->left);
+            if (!execute_interrupted())
+                execute_node(cmd->list->right);
+            break;
+        case AND:
+        case OR:
+            execute_node(cmd->list->left);
+            if (!execute_interrupted()
+                && (gstate.exitstatus == 0) == (cmd->type == AND))
+                execute_node(cmd->list->right);
             break;
         default:
-            error_exit("unrecognized command", EXIT_FAILURE);
+            printerr("unrecognized command");
+            gstate.exitstatus = EXITCODE(EXIT_FAILURE);
     }
 }
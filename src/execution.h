@@ -2,11 +2,15 @@
 #define EXECUTION_H
 
 #include "parse.h"
+#include "jobs.h"
 
 #define ERROR_NOT_EXECUTABLE     126
 #define ERROR_NOT_FOUND          127
 #define WR_PERMS                 0644
+#define ARG_STRLEN_PAGES         32  /* Linux's limit on a single argument */
 
-void    execute_node(parsenode_t *, int);
+void    execute_node(parsenode_t *);
+pid_t   execute_argv(char **, int [3], job_t *, int *);
+int     execute_interrupted(void);
 
 #endif
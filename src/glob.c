@@ -0,0 +1,491 @@
+#define _GNU_SOURCE     /* O_DIRECTORY, fstatat */
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "icshell.h"
+#include "lexer.h"
+#include "glob.h"
+#include "arena.h"
+#include "trace.h"
+
+/* What getdents64 fills its buffer with */
+typedef struct
+{
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+} linux_dirent64_t;
+
+/* A pattern split at its slashes, walked one directory level at a time */
+typedef struct
+{
+    globseg_t   *segs;
+    size_t      nsegs;
+    int         dironly;    /* the pattern ends with a slash */
+    char        *dents;
+    wordlist_t  *out;
+} globwalk_t;
+
+/* Appends word, keeping room for the NULL that ends an argv */
+void    wordlist_add(wordlist_t *list, char *word)
+{
+    size_t  cap;
+
+    if (list->n + 1 >= list->cap)
+    {
+        cap = list->cap ? list->cap * 2 : GLOB_WORDS_MIN;
+        list->words = arena_resize(list->words, sizeof(char *) * list->cap,
+                                   sizeof(char *) * cap);
+        list->cap = cap;
+    }
+    list->words[list->n++] = word;
+}
+
+static char unmark(char c)
+{
+    if (c == GLOB_STAR)
+        return '*';
+    if (c == GLOB_ANY)
+        return '?';
+    if (c == GLOB_CLASS)
+        return '[';
+    return c;
+}
+
+static void set_add(uint8_t *set, unsigned char c)
+{
+    set[c / 8] |= 1 << (c % 8);
+}
+
+static int  set_has(uint8_t *set, unsigned char c)
+{
+    return set[c / 8] & (1 << (c % 8));
+}
+
+/* [:name:] inside brackets, s is after "[:". Returns the length of
+ * "name:]", 0 if name is not a class. */
+static size_t named_class(uint8_t *set, char *s, size_t len)
+{
+    static const struct
+    {
+        char    *name;
+        int     (*is)(int);
+    } classes[] = {
+        { "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank },
+        { "cntrl", iscntrl }, { "digit", isdigit }, { "graph", isgraph },
+        { "lower", islower }, { "print", isprint }, { "punct", ispunct },
+        { "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit },
+    };
+    size_t  n;
+
+    for (size_t i = 0; i < sizeof(classes) / sizeof(*classes); i++)
+    {
+        n = strlen(classes[i].name);
+        if (n + 2 > len || strncmp(s, classes[i].name, n)
+            || s[n] != ':' || s[n + 1] != ']')
+            continue;
+        for (int c = 1; c < 256; c++)
+        {
+            if (classes[i].is(c))
+                set_add(set, c);
+        }
+        return n + 2;
+    }
+    return 0;
+}
+
+/* Compiles [...] starting after the [ into op. Returns how much of s it
+ * took up to and including the ], 0 if there is no ] and the [ is just
+ * a character. */
+static size_t compile_class(globop_t *op, char *s, size_t len)
+{
+    size_t          i, first, n;
+    unsigned char   c, last;
+
+    memset(op, 0, sizeof(*op));
+    op->type = GOP_CLASS;
+    i = 0;
+    if (i < len && (s[i] == '!' || s[i] == '^'))
+    {
+        op->negate = 1;
+        i++;
+    }
+    for (first = i; i < len; i++)
+    {
+        if (s[i] == MARK_ESC && i + 1 < len)
+        {
+            set_add(op->set, s[++i]);
+            continue;
+        }
+        c = unmark(s[i]);
+        if (c == ']' && i > first)
+            return i + 1;
+        if (c == '[' && i + 1 < len && s[i + 1] == ':'
+            && (n = named_class(op->set, s + i + 2, len - i - 2)) != 0)
+        {
+            i += n + 1;
+            continue;
+        }
+        if (i + 2 < len && s[i + 1] == '-' && s[i + 2] != ']')
+        {
+            last = unmark(s[i + 2]);
+            for (unsigned int k = c; k <= last; k++)
+                set_add(op->set, k);
+            i += 2;
+            continue;
+        }
+        set_add(op->set, c);
+    }
+    return 0;
+}
+
+static globop_t *new_op(globseg_t *seg, size_t *cap)
+{
+    size_t  size;
+
+    if (seg->nops == *cap)
+    {
+        size = sizeof(*seg->ops) * *cap;
+        *cap *= 2;
+        seg->ops = arena_resize(seg->ops, size, size * 2);
+    }
+    return &seg->ops[seg->nops++];
+}
+
+/* Turns one path component of a pattern, with its marks, into ops. The
+ * literals are copied without marks or escapes to seg->lit as well. */
+static void compile(globseg_t *seg, char *s, size_t len)
+{
+    globop_t    *op, class;
+    size_t      cap, n;
+    char        *lit, c;
+    int         esc;
+
+    memset(seg, 0, sizeof(*seg));
+    cap = len + 1;
+    seg->ops = arena_alloc(sizeof(*seg->ops) * cap);
+    seg->lit = arena_alloc(len + 1);
+    lit = arena_alloc(len + 1);
+    for (size_t i = 0; i < len; i++)
+    {
+        esc = (s[i] == MARK_ESC && i + 1 < len);
+        i += esc;
+        c = esc ? s[i] : unmark(s[i]);
+        seg->lit[seg->litlen++] = c;
+        n = 0;
+        if (!esc && s[i] == GLOB_CLASS
+            && (n = compile_class(&class, s + i + 1, len - i - 1)) != 0)
+        {
+            *new_op(seg, &cap) = class;
+            memcpy(seg->lit + seg->litlen, s + i + 1, n);
+            seg->litlen += n;
+            i += n;
+            seg->minlen++;
+        }
+        else if (!esc && s[i] == GLOB_STAR)
+        {
+            if (!seg->nops || seg->ops[seg->nops - 1].type != GOP_STAR)
+                new_op(seg, &cap)->type = GOP_STAR;
+            seg->star = 1;
+        }
+        else if (!esc && s[i] == GLOB_ANY)
+        {
+            new_op(seg, &cap)->type = GOP_ANY;
+            seg->minlen++;
+        }
+        else
+        {
+            op = seg->nops ? &seg->ops[seg->nops - 1] : NULL;
+            if (!op || op->type != GOP_LITERAL)
+            {
+                op = new_op(seg, &cap);
+                op->type = GOP_LITERAL;
+                op->lit = lit;
+                op->len = 0;
+            }
+            *lit++ = c;
+            op->len++;
+            seg->minlen++;
+        }
+    }
+    seg->lit[seg->litlen] = '\0';
+    for (size_t i = 0; i < seg->nops; i++)
+        seg->magic |= seg->ops[i].type != GOP_LITERAL;
+    seg->dots = seg->nops && seg->ops[0].type == GOP_LITERAL
+                && *seg->ops[0].lit == '.';
+    if (seg->nops && seg->ops[0].type == GOP_LITERAL)
+    {
+        seg->prefix = seg->ops[0].lit;
+        seg->prefixlen = seg->ops[0].len;
+    }
+    /* everything after the last * has a fixed length, so a literal at the
+     * end has to be at the end of the name */
+    if (seg->nops > 1 && seg->ops[seg->nops - 1].type == GOP_LITERAL)
+    {
+        seg->suffix = seg->ops[seg->nops - 1].lit;
+        seg->suffixlen = seg->ops[seg->nops - 1].len;
+    }
+}
+
+/* Runs ops over name. Every op but * matches a fixed number of bytes, so
+ * when something does not match it is enough to let the last * take one
+ * more byte and try again from there. */
+static int  match_ops(globop_t *ops, size_t nops, char *name, size_t len)
+{
+    size_t          i, j, star_i, star_j;
+    globop_t        *op;
+    unsigned char   c;
+
+    i = 0;
+    j = 0;
+    star_i = (size_t)-1;
+    star_j = 0;
+    while (i < nops || j < len)
+    {
+        if (i < nops)
+        {
+            op = &ops[i];
+            if (op->type == GOP_STAR)
+            {
+                if (i + 1 == nops)
+                    return 1;
+                star_i = i++;
+                star_j = j;
+                continue;
+            }
+            if (op->type == GOP_LITERAL && len - j >= op->len
+                && !memcmp(name + j, op->lit, op->len))
+            {
+                i++;
+                j += op->len;
+                continue;
+            }
+            if (op->type != GOP_LITERAL && j < len)
+            {
+                c = name[j];
+                if (op->type == GOP_ANY
+                    || (set_has(op->set, c) != 0) != op->negate)
+                {
+                    i++;
+                    j++;
+                    continue;
+                }
+            }
+        }
+        if (star_i == (size_t)-1 || star_j >= len)
+            return 0;
+        i = star_i + 1;
+        j = ++star_j;
+    }
+    return 1;
+}
+
+/* Checks the length and the literals at both ends before running the ops,
+ * which rules out most names of a big directory for e.g. *.log */
+static int  match(globseg_t *seg, char *name, size_t len)
+{
+    size_t  first, last;
+
+    if (len < seg->minlen || (!seg->star && len != seg->minlen))
+        return 0;
+    if (*name == '.' && !seg->dots)
+        return 0;
+    if (seg->suffixlen
+        && memcmp(name + len - seg->suffixlen, seg->suffix, seg->suffixlen))
+        return 0;
+    if (seg->prefixlen && memcmp(name, seg->prefix, seg->prefixlen))
+        return 0;
+    first = seg->prefixlen != 0;
+    last = seg->nops - (seg->suffixlen != 0);
+    return match_ops(seg->ops + first, last - first, name + seg->prefixlen,
+                     len - seg->prefixlen - seg->suffixlen);
+}
+
+static char *join(char *path, size_t pathlen, char *name, size_t len,
+                  int slash)
+{
+    char    *s;
+
+    s = arena_alloc(pathlen + len + slash + 1);
+    memcpy(s, path, pathlen);
+    memcpy(s + pathlen, name, len);
+    if (slash)
+        s[pathlen + len] = '/';
+    s[pathlen + len + slash] = '\0';
+    return s;
+}
+
+/* d_type is enough unless the entry is a symlink or the filesystem does
+ * not fill it in */
+static int  is_dir(int dirfd, linux_dirent64_t *d)
+{
+    struct stat st;
+
+    if (d->d_type == DT_DIR)
+        return 1;
+    if (d->d_type != DT_LNK && d->d_type != DT_UNKNOWN)
+        return 0;
+    return fstatat(dirfd, d->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void walk(globwalk_t *g, int dirfd, char *path, size_t pathlen,
+                 size_t i);
+
+/* A component without patterns is opened or checked directly */
+static void walk_literal(globwalk_t *g, int dirfd, char *path,
+                         size_t pathlen, size_t i)
+{
+    globseg_t   *seg;
+    struct stat st;
+    int         fd;
+
+    seg = &g->segs[i];
+    if (i + 1 == g->nsegs)
+    {
+        if (fstatat(dirfd, seg->lit, &st, g->dironly ? 0 : AT_SYMLINK_NOFOLLOW)
+            == 0 && (!g->dironly || S_ISDIR(st.st_mode)))
+            wordlist_add(g->out, join(path, pathlen, seg->lit, seg->litlen,
+                                      g->dironly));
+        return;
+    }
+    fd = openat(dirfd, seg->lit, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    path = join(path, pathlen, seg->lit, seg->litlen, 1);
+    walk(g, fd, path, pathlen + seg->litlen + 1, i + 1);
+    close(fd);
+}
+
+/* Reads the entries of dirfd in big batches. Matches of the last component
+ * are results, those of another one are directories to go into, which is
+ * only done once the whole directory is read so that the buffer can be
+ * used again. Anything that is not a directory is never looked at again. */
+static void walk_dir(globwalk_t *g, int dirfd, char *path, size_t pathlen,
+                     size_t i)
+{
+    linux_dirent64_t    *d;
+    wordlist_t          dirs;
+    globseg_t           *seg;
+    long                n;
+    size_t              len;
+    int                 last, fd;
+
+    seg = &g->segs[i];
+    last = (i + 1 == g->nsegs);
+    dirs = (wordlist_t){ 0 };
+    while ((n = syscall(SYS_getdents64, dirfd, g->dents, GLOB_DENTS_BUF)) > 0)
+    {
+        for (long off = 0; off < n; off += d->d_reclen)
+        {
+            d = (linux_dirent64_t *)(g->dents + off);
+            len = strlen(d->d_name);
+            if ((d->d_name[0] == '.' && (len == 1
+                                         || (len == 2 && d->d_name[1] == '.')))
+                || !match(seg, d->d_name, len))
+                continue;
+            if (last && !g->dironly)
+                wordlist_add(g->out, join(path, pathlen, d->d_name, len, 0));
+            else if (is_dir(dirfd, d))
+                wordlist_add(last ? g->out : &dirs,
+                             join(path, pathlen, d->d_name, len, 1));
+        }
+    }
+    for (size_t k = 0; k < dirs.n; k++)
+    {
+        fd = openat(dirfd, dirs.words[k] + pathlen,
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            continue;
+        walk(g, fd, dirs.words[k], strlen(dirs.words[k]), i + 1);
+        close(fd);
+    }
+}
+
+static void walk(globwalk_t *g, int dirfd, char *path, size_t pathlen,
+                 size_t i)
+{
+    int fd;
+
+    if (!g->segs[i].magic)
+        walk_literal(g, dirfd, path, pathlen, i);
+    else if (dirfd != AT_FDCWD)
+        walk_dir(g, dirfd, path, pathlen, i);
+    else if ((fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1)
+    {
+        walk_dir(g, fd, path, pathlen, i);
+        close(fd);
+    }
+}
+
+static int  compare_words(const void *p1, const void *p2)
+{
+    return strcmp(*(char *const *)p1, *(char *const *)p2);
+}
+
+/* Appends the paths word matches to out, sorted, and returns how many
+ * there are. A word without pattern marks is never looked up. Either way
+ * word is left without its marks and escapes, so that it can be used as it is if nothing
+ * matched, like in bash. */
+size_t  glob_expand(char *word, wordlist_t *out)
+{
+    globwalk_t  g;
+    size_t      start, nsegs, len;
+    long long   begin;
+    char        *s, *slash;
+    int         dirfd, magic;
+
+    if (!strpbrk(word, GLOB_MARKS))
+    {
+        lexer_unmark(word);
+        return 0;
+    }
+    begin = trace_now();
+    nsegs = 1;
+    for (s = word; (s = strchr(s, '/')) != NULL; s++)
+        nsegs++;
+    g.segs = arena_alloc(sizeof(*g.segs) * nsegs);
+    g.nsegs = 0;
+    g.dironly = 0;
+    g.out = out;
+    magic = 0;
+    for (s = word; *s; s = slash + !!*slash)
+    {
+        slash = strchrnul(s, '/');
+        if ((len = slash - s) == 0)  /* a leading or doubled slash */
+            continue;
+        compile(&g.segs[g.nsegs], s, len);
+        magic |= g.segs[g.nsegs++].magic;
+    }
+    g.dironly = (s > word && s[-1] == '/');
+    lexer_unmark(word);
+    start = out->n;
+    if (magic && g.nsegs)
+    {
+        g.dents = malloc(GLOB_DENTS_BUF);
+        assert(g.dents);
+        if (*word == '/')
+        {
+            dirfd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dirfd != -1)
+            {
+                walk(&g, dirfd, "/", 1, 0);
+                close(dirfd);
+            }
+        }
+        else
+            walk(&g, AT_FDCWD, "", 0, 0);
+        free(g.dents);
+        qsort(out->words + start, out->n - start, sizeof(*out->words),
+              &compare_words);
+    }
+    trace_span("glob", begin, word);
+    return out->n - start;
+}
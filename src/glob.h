@@ -0,0 +1,57 @@
+#ifndef GLOB_H
+#define GLOB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GLOB_DENTS_BUF  (64 * 1024) /* bytes of entries per getdents64 */
+#define GLOB_WORDS_MIN  16          /* initial size of a wordlist_t */
+
+/* The words a command expands to, growing in the arena */
+typedef struct
+{
+    char    **words;
+    size_t  n;
+    size_t  cap;
+} wordlist_t;
+
+typedef enum
+{
+    GOP_LITERAL,    /* len bytes at lit */
+    GOP_ANY,        /* ? */
+    GOP_STAR,       /* * */
+    GOP_CLASS       /* [...], one byte in set */
+} globop_type_t;
+
+typedef struct
+{
+    uint8_t     type;
+    uint8_t     negate;     /* [!...] or [^...] */
+    uint32_t    len;
+    char        *lit;
+    uint8_t     set[32];    /* a bit per byte value */
+} globop_t;
+
+/* One path component of a pattern, compiled. A name has to be at least
+ * minlen long and start with prefix and end with suffix (the literals
+ * before the first and after the last *) before ops are even tried. */
+typedef struct
+{
+    globop_t    *ops;
+    size_t      nops;
+    size_t      minlen;
+    char        *lit;       /* the component without marks */
+    size_t      litlen;
+    char        *prefix;
+    size_t      prefixlen;
+    char        *suffix;
+    size_t      suffixlen;
+    int         magic;      /* whether it has any *, ? or [...] */
+    int         star;       /* whether names of any length can match */
+    int         dots;       /* whether it matches names starting with . */
+} globseg_t;
+
+void    wordlist_add(wordlist_t *, char *);
+size_t  glob_expand(char *, wordlist_t *);
+
+#endif
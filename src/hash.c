@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include "icshell.h"
+#include "hash.h"
+#include "vars.h"
+
+/* Command name -> absolute path cache. It lives in the parent shell, which
+ * resolves every command right before launching it. Commands which could
+ * not be found are not cached, so one installed later is found like in
+ * bash. */
+static hashentry_t  *table[HASH_BUCKETS];
+
+/* FNV-1a */
+static unsigned int hash_string(char *s)
+{
+    unsigned int h;
+
+    h = 2166136261u;
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h % HASH_BUCKETS;
+}
+
+/* walks PATH once without copying it, returns the first existing file */
+static char *path_search(char *cmd)
+{
+    char    *env_path, *start, *end, *full_path;
+    size_t  dir_len, cmd_len;
+
+    env_path = vars_get("PATH");
+    if (!env_path || !*env_path)
+        return NULL;
+    cmd_len = strlen(cmd);
+    full_path = malloc(strlen(env_path) + cmd_len + 2);
+    assert(full_path);
+    for (start = env_path; *start; start = end + (*end == ':'))
+    {
+        end = strchr(start, ':');
+        if (!end)
+            end = start + strlen(start);
+        dir_len = end - start;
+        if (dir_len == 0)   /* empty entries are skipped like before */
+            continue;
+        memcpy(full_path, start, dir_len);
+        full_path[dir_len] = '/';
+        memcpy(full_path + dir_len + 1, cmd, cmd_len + 1);
+        if (access(full_path, F_OK) == 0)
+            return full_path;
+    }
+    free(full_path);
+    return NULL;
+}
+
+/* returns the cached entry for cmd without searching PATH */
+hashentry_t *hash_get(char *cmd)
+{
+    hashentry_t *entry;
+
+    for (entry = table[hash_string(cmd)]; entry; entry = entry->next)
+    {
+        if (!strcmp(entry->name, cmd))
+            return entry;
+    }
+    return NULL;
+}
+
+/* returns the absolute path of cmd from PATH, searching only on a cache miss.
+ * The returned string belongs to the cache, do not free it. */
+char *hash_lookup(char *cmd)
+{
+    hashentry_t     *entry;
+    unsigned int    bucket;
+    char            *path;
+
+    if (!cmd || !*cmd || *cmd == '.' || strchr(cmd, '/'))
+        return NULL;
+    entry = hash_get(cmd);
+    if (!entry)
+    {
+        if ((path = path_search(cmd)) == NULL)
+            return NULL;
+        entry = malloc(sizeof(*entry));
+        assert(entry);
+        entry->name = strdup(cmd);
+        assert(entry->name);
+        entry->path = path;
+        entry->hits = 0;
+        bucket = hash_string(cmd);
+        entry->next = table[bucket];
+        table[bucket] = entry;
+    }
+    entry->hits++;
+    return entry->path;
+}
+
+/* drops cmd from the cache, e.g. when its file went away */
+void hash_forget(char *cmd)
+{
+    hashentry_t **link, *entry;
+
+    for (link = &table[hash_string(cmd)]; *link; link = &(*link)->next)
+    {
+        entry = *link;
+        if (!strcmp(entry->name, cmd))
+        {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+    }
+}
+
+/* forget everything, called when PATH changes and by `hash -r' */
+void hash_clear(void)
+{
+    hashentry_t *entry, *next;
+
+    for (int i = 0; i < HASH_BUCKETS; i++)
+    {
+        for (entry = table[i]; entry; entry = next)
+        {
+            next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+        table[i] = NULL;
+    }
+}
+
+/* same output format as bash */
+void hash_print(void)
+{
+    hashentry_t *entry;
+    int         empty;
+
+    empty = 1;
+    for (int i = 0; i < HASH_BUCKETS; i++)
+    {
+        for (entry = table[i]; entry; entry = entry->next)
+        {
+            if (empty)
+                fputs("hits\tcommand\n", stdout);
+            empty = 0;
+            printf("%4d\t%s\n", entry->hits, entry->path);
+        }
+    }
+    if (empty)
+        fputs("hash: hash table empty\n", stdout);
+}
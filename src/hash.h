@@ -0,0 +1,20 @@
+#ifndef HASH_H
+#define HASH_H
+
+#define HASH_BUCKETS        64
+
+typedef struct hashentry_s
+{
+    struct hashentry_s  *next;  /* next entry in the same bucket */
+    char                *name;  /* the command as typed */
+    char                *path;  /* absolute path */
+    int                 hits;   /* how many times the entry was used */
+} hashentry_t;
+
+hashentry_t *hash_get(char *);
+char        *hash_lookup(char *);
+void        hash_forget(char *);
+void        hash_clear(void);
+void        hash_print(void);
+
+#endif
@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+#include "icshell.h"
+#include "heredoc.h"
+#include "signals.h"
+#include "vars.h"
+
+static void write_all(heredoc_out_t *out, char *s, size_t len)
+{
+    ssize_t w;
+
+    while (len && !out->error)
+    {
+        if ((w = write(out->fd, s, len)) < 0)
+            out->error = 1;
+        else
+        {
+            s += w;
+            len -= w;
+        }
+    }
+}
+
+static void out_flush(heredoc_out_t *out)
+{
+    write_all(out, out->buf, out->len);
+    out->len = 0;
+}
+
+static void out_write(heredoc_out_t *out, char *s, size_t len)
+{
+    if (out->len + len > sizeof(out->buf))
+    {
+        out_flush(out);
+        if (len > sizeof(out->buf)) /* huge values skip the buffer */
+        {
+            write_all(out, s, len);
+            return;
+        }
+    }
+    memcpy(out->buf + out->len, s, len);
+    out->len += len;
+}
+
+/* Writes line to out with $VAR and the special parameters substituted,
+ * with the same name rules as the lexer. Quotes mean nothing in a heredoc. */
+static void expand_line(heredoc_out_t *out, char *line)
+{
+    char    *start, *name_end, *value, num[INT_STRINGLEN + 1], c;
+
+    start = line;
+    while ((line = strchr(line, '$')) != NULL)
+    {
+        c = line[1];
+        if (!c || (!isalnum(c) && !strchr("_?$#@*", c)))
+        {
+            line++;
+            continue;
+        }
+        out_write(out, start, line - start);
+        name_end = line + 2;
+        if (isalpha(c) || c == '_')
+        {
+            while (isalnum(*name_end) || *name_end == '_')
+                name_end++;
+        }
+        if ((value = vars_special(line + 1, num)) == NULL)
+        {
+            c = *name_end;
+            *name_end = '\0';
+            value = vars_get(line + 1);
+            *name_end = c;
+        }
+        if (value)
+            out_write(out, value, strlen(value));
+        line = name_end;
+        start = line;
+    }
+    out_write(out, start, strlen(start));
+}
+
+/* Reads lines from stdin up to delim into fd, expanding them unless the
+ * delimiter was quoted. Returns -1 if interrupted or the write failed. */
+int heredoc_read(int fd, char *delim, int expand)
+{
+    heredoc_out_t   out;
+    size_t          dlen;
+    char            *line;
+
+    out.fd = fd;
+    out.len = 0;
+    out.error = 0;
+    handle_signals(HEREDOC_MODE);
+    gstate.interrupted = 0;
+    dlen = strlen(delim);
+    fputs("> ", stdout);
+    fflush(stdout);
+    while ((line = get_next_line()) != NULL && !gstate.interrupted)
+    {
+        if (!strncmp(line, delim, dlen) && (!line[dlen] || line[dlen] == '\n'))
+            break;
+        if (expand)
+            expand_line(&out, line);
+        else
+            out_write(&out, line, strlen(line));
+        free(line);
+        fputs("> ", stdout);
+        fflush(stdout);
+    }
+    free(line);
+    out_flush(&out);
+    get_next_line_sync();
+    handle_signals(NO_MODE);
+    if (out.error)
+        perror_status("heredoc", EXIT_FAILURE);
+    if (gstate.interrupted) /* ^C, throw away the whole command */
+        gstate.exitstatus = EXITCODE(SIGINT + 128);
+    return (gstate.interrupted || out.error) ? -1 : 0;
+}
@@ -0,0 +1,18 @@
+#ifndef HEREDOC_H
+#define HEREDOC_H
+
+#include <stddef.h>
+
+#define HEREDOC_BUFSIZE     65536
+
+typedef struct
+{
+    int     fd;                     /* where the body goes */
+    int     error;                  /* a write failed, stop writing */
+    size_t  len;                    /* bytes waiting in buf */
+    char    buf[HEREDOC_BUFSIZE];
+} heredoc_out_t;
+
+int     heredoc_read(int, char *, int);
+
+#endif
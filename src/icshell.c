@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <sys/types.h>
@@ -10,75 +12,90 @@
 #include "parse.h"
 #include "execution.h"
 #include "signals.h"
+#include "jobs.h"
+#include "trace.h"
+#include "script.h"
+#include "arena.h"
+#include "complete.h"
 #include "asciiart.h"
 
 gstate_t    gstate;
 
+/* Everything the line needs from lexing to expansion is in the arena and
+ * given back at once when it is done */
 static void process(char *line)
 {
-    lexlist_t   *lexlist;
-    parsenode_t *parsetree;
+    lexlist_t       *lexlist;
+    parsenode_t     *parsetree;
+    arena_mark_t    mark;
+    long long       start;
 
-    lexlist = lexer_create(line);
-    lexlist = lexer_simplify(lexlist);
-    handle_signals(NO_MODE);
-    if (!lexlist || !lexlist->head)
+    mark = arena_mark();
+    if ((parsetree = parse_line(line, &lexlist)) != NULL)
     {
-        free(lexlist);
-        return;
+        start = trace_now();
+        execute_node(parsetree);
+        trace_span("execute_node", start, NULL);
+        parsetree_close(parsetree);
     }
-    if (!builtins_handle(lexlist->head))
+    arena_release(mark);
+}
+
+/* Runs every line of script, returns the status of the last command like
+ * bash does */
+static int  run_script(script_t *script)
+{
+    char    *line;
+
+    jobs_init(0);
+    while ((line = script_next_line(script)) != NULL)
     {
-        if (fork_and_check() == 0) /* Child process */
-        {
-            handle_signals(EXECUTING_MODE);
-            parsetree = parse_create(lexlist);
-            execute_node(parsetree, 0);
-        }
-        wait(&gstate.exitstatus);
-        signals_check_exit(gstate.exitstatus, 1); /* print newline as well */
+        jobs_poll(0);
+        process(line);
     }
-    lexlist_free(lexlist);
+    script_close(script);
+    return status_code(gstate.exitstatus);
 }
 
-int run_from_file(char *filename)
+/* icshell -c 'command' [$0 [$1...]] or icshell script [$1...] */
+static int  run_noninteractive(int argc, char **argv)
 {
-    FILE    *file;
-    char    buf[BUFSIZ], *newline;
+    script_t    *script;
 
-    file = fopen(filename, "r");
-    if (!file)
-        perror_exit(filename, EXIT_FAILURE);
-    /* Do not use an internal buffer because our program messes it up
-     * for some reason. If you remove this line the file will infinitely
-     * read and the program never terminates. */
-    setvbuf(stdin, NULL, _IONBF, 0);
-    setvbuf(stdout, NULL, _IONBF, 0);
-    setvbuf(file, NULL, _IONBF, 0);
-    while (fgets(buf, sizeof(buf), file))
+    if (!strcmp(argv[1], "-c"))
     {
-
-        newline = strchr(buf, '\n');
-        if (newline)
-            *newline = '\0';
-        process(buf);
+        if (argc < 3)
+        {
+            printerr("-c: option requires an argument");
+            return EXIT_INVALID_BUILTIN;
+        }
+        if (argc > 3)
+            setup_env(argc - 3, argv + 3);
+        else
+            setup_env(1, argv);
+        return run_script(script_string(argv[2]));
     }
-    if (ferror(file))
-        perror_exit(filename, EXIT_FAILURE);
-    fclose(file);
-    return EXIT_SUCCESS;
+    setup_env(argc - 1, argv + 1);
+    if ((script = script_open(argv[1])) == NULL)
+        perror_exit(argv[1], (errno == ENOENT) ? ERROR_NOT_FOUND
+                    : ERROR_NOT_EXECUTABLE);
+    return run_script(script);
 }
 
 int main(int argc, char **argv)
 {
     char    *command_line, *prompt;
 
+    trace_init();
+    if (argc > 1)
+        return run_noninteractive(argc, argv);
     setup_env(argc, argv);
-    if (argc == 3 && !strcmp("-c", argv[1]))
-        return run_from_file(argv[2]);
     fputs(WELCOME_MESSAGE, stdout);
+    jobs_init(1);
+    complete_init();
     while (1)
     {
+        jobs_poll(1);
         handle_signals(INTERACTIVE_MODE);
         prompt = current_dir_prompt();
         command_line = readline(prompt);
@@ -3,8 +3,10 @@
 
 #include <sys/types.h>
 #include <stdio.h>
+#include <signal.h>
 
 #define ICSHELL_NAME        "ICshell"
+#define ICSHELL_VERSION     "1.1"
 
 #define COLORS_ENABLED      (isatty(STDOUT_FILENO))
 #define COLOR               "\033[1;96m"
@@ -14,14 +16,16 @@
 
 #define PROMPT_PREFIX       ICSHELL_NAME":"
 #define PROMPT_LEN          ((sizeof(PROMPT_PREFIX) - 1) + COLOR_LEN)
-#define GNL_BUFFER_SIZE     64
+#define GNL_BUFFER_SIZE     4096
 #define INT_STRINGLEN       11 /* max is -2147483648 */
 
 #define EXITCODE(code)      ((code) << 8)
 
 typedef struct gstate_t
 {
-    int     exitstatus;
+    int                     exitstatus;
+    volatile sig_atomic_t   interrupted;    /* SIGINT while reading heredoc */
+    pid_t                   pid;            /* $$, the same in forked copies */
 } gstate_t;
 
 /* Global */
@@ -29,17 +33,18 @@ extern gstate_t gstate;
 extern char     **environ;
 
 /* util.c */
-void    copy_envp(char **);
-void    free_envp(void);
 void    printerr(char *);
 void    printerr_status(char *, int);
 void    error_exit(char *, int);
 void    syntax_error(char *);
 void    perror_exit(char *, int);
+void    perror_status(char *, int);
 pid_t   fork_and_check(void);
 char    *get_next_line(void);
-FILE    *fmkstemp(char *);
+void    get_next_line_sync(void);
+int     anon_file(char *);
 char    *itoa(int);
+int     status_code(int);
 void    setup_env(int, char **);
 void    custom_puts(char *, int);
 char    *current_dir_prompt(void);
@@ -0,0 +1,659 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdio.h>
+#include <signal.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/signalfd.h>
+#include "icshell.h"
+#include "parse.h"
+#include "jobs.h"
+#include "trace.h"
+
+static job_t            *table;         /* background and stopped jobs */
+static int              job_control;
+static pid_t            shell_pgid;
+static struct termios   shell_tmodes;
+static int              sigchld_fd = -1;
+static int              sigchld_pending; /* drained by jobs_wait_child */
+
+/* SIGCHLD stays blocked in the shell and is read from a signalfd before
+ * every prompt instead. With a terminal on stdin the shell also takes a
+ * process group of its own and hands the terminal to foreground jobs. */
+void    jobs_init(int interactive)
+{
+    sigset_t    mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (!interactive || !isatty(STDIN_FILENO))
+        return;
+    /* started in the background, wait until we are brought to the front */
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp()))
+        kill(-shell_pgid, SIGTTIN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    shell_pgid = getpid();
+    if (getpgrp() != shell_pgid && setpgid(0, shell_pgid) == -1)
+        return;
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
+    job_control = 1;
+}
+
+int jobs_control(void)
+{
+    return job_control;
+}
+
+/* forked builtins keep it open to wait for the children they start */
+int jobs_fileno(void)
+{
+    return sigchld_fd;
+}
+
+/* A forked copy of the shell leaves the terminal and the jobs alone */
+void    jobs_forked(void)
+{
+    job_control = 0;
+    table = NULL;
+}
+
+static void describe_word(FILE *fp, char *word)
+{
+    word = strdup(word);
+    assert(word);
+    lexer_unmark(word);
+    fputs(word, fp);
+    free(word);
+}
+
+static void describe(FILE *fp, parsenode_t *node)
+{
+    char    *op;
+
+    switch (node->type)
+    {
+        case EXEC:
+            for (int i = 0; node->exec->argv && node->exec->argv[i]; i++)
+            {
+                if (i)
+                    fputc(' ', fp);
+                describe_word(fp, node->exec->argv[i]);
+            }
+            break;
+        case REDIR:
+            describe(fp, node->redir->cmd);
+            switch (node->redir->type)
+            {
+                case REDIR_IN:  op = "<";   break;
+                case REDIR_APP: op = ">>";  break;
+                case HERE_DOC:  op = "<<";  break;
+                default:        op = ">";   break;
+            }
+            fprintf(fp, " %s ", op);
+            describe_word(fp, node->redir->file);
+            break;
+        case PIPE:
+            describe(fp, node->pipe->left);
+            fputs(" | ", fp);
+            describe(fp, node->pipe->right);
+            break;
+        case ASYNC:
+            describe(fp, node->async);
+            break;
+        case TIME:
+            fputs(TIME_WORD" ", fp);
+            describe(fp, node->timed);
+            break;
+        case LIST:
+        case AND:
+        case OR:
+            describe(fp, node->list->left);
+            fputs(node->type == LIST ? "; "
+                    : (node->type == AND ? " && " : " || "), fp);
+            describe(fp, node->list->right);
+            break;
+    }
+}
+
+job_t   *job_new(parsenode_t *cmd, int n, int foreground)
+{
+    job_t   *job;
+    size_t  len;
+    FILE    *fp;
+
+    job = calloc(1, sizeof(*job));
+    assert(job);
+    job->pids = calloc(n, sizeof(*job->pids));
+    job->statuses = calloc(n, sizeof(*job->statuses));
+    assert(job->pids && job->statuses);
+    job->n = n;
+    job->foreground = foreground;
+    job->state = JOB_RUNNING;
+    fp = open_memstream(&job->text, &len);
+    assert(fp);
+    if (cmd)
+        describe(fp, cmd);
+    fclose(fp);
+    return job;
+}
+
+void    job_free(job_t *job)
+{
+    if (job->release)
+        job->release(job);
+    if (job->time)
+    {
+        for (int i = 0; i < job->n; i++)
+            free(job->time->names[i]);
+        free(job->time->names);
+        free(job->time->ends);
+        free(job->time->usage);
+        free(job->time);
+    }
+    free(job->pids);
+    free(job->statuses);
+    free(job->text);
+    free(job);
+}
+
+/* Records the pid of stage i, -1 if it could not be started. The first
+ * child gives its pid to the whole job as the process group. */
+void    job_started(job_t *job, int i, pid_t pid)
+{
+    job->pids[i] = pid;
+    if (pid <= 0 || !job_control)
+        return;
+    if (!job->pgid)
+    {
+        job->pgid = pid;
+        if (job->foreground) /* the sooner the better, see job_wait */
+            tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    setpgid(pid, job->pgid); /* a forked child might not have done it yet */
+}
+
+/* Makes job report what its stages used once it is done, see print_times.
+ * Stages that never start count as ending right away. */
+void    job_timed(job_t *job)
+{
+    jobtime_t   *time;
+
+    time = malloc(sizeof(*time));
+    assert(time);
+    time->ends = malloc(sizeof(*time->ends) * job->n);
+    time->usage = calloc(job->n, sizeof(*time->usage));
+    time->names = calloc(job->n, sizeof(*time->names));
+    assert(time->ends && time->usage && time->names);
+    clock_gettime(CLOCK_MONOTONIC, &time->start);
+    for (int i = 0; i < job->n; i++)
+    {
+        time->ends[i] = time->start;
+        time->usage[i].ru_maxrss = -1;
+    }
+    job->time = time;
+}
+
+/* Stage i of a timed job is over and used ru */
+void    job_usage(job_t *job, int i, struct rusage *ru)
+{
+    if (!job->time)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &job->time->ends[i]);
+    job->time->usage[i] = *ru;
+}
+
+static double   since(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec)
+        + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double   seconds(struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* a negative max RSS was not measured and prints as - */
+static void print_usage(char *name, double real, struct rusage *ru)
+{
+    char    rss[INT_STRINGLEN * 2];
+
+    if (ru->ru_maxrss < 0)
+        strcpy(rss, "-");
+    else
+        sprintf(rss, "%ld", ru->ru_maxrss);
+    fprintf(stderr, "%-12.12s %8.3f %8.3f %8.3f %9s %7ld %7ld %7ld %7ld\n",
+            name, real, seconds(&ru->ru_utime), seconds(&ru->ru_stime),
+            rss, ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt);
+}
+
+/* One line per stage, then their sum for a pipeline, or only the sum for a
+ * `time` without a command like in bash. The real time of a stage runs
+ * from the launch of the job until the stage was reaped, so the slowest
+ * stage is the one with the largest. Max RSS is in KiB, and - for builtins
+ * run in the shell, which only has the shell's own peak to show. */
+static void print_times(job_t *job)
+{
+    jobtime_t       *time;
+    struct rusage   total;
+    double          real, last;
+    int             bare;
+
+    time = job->time;
+    memset(&total, 0, sizeof(total));
+    total.ru_maxrss = -1;
+    last = 0;
+    bare = (job->n == 1 && !time->names[0]);
+    fprintf(stderr, "%-12s %8s %8s %8s %9s %7s %7s %7s %7s\n", "command",
+            "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "minflt",
+            "majflt");
+    for (int i = 0; i < job->n; i++)
+    {
+        real = since(&time->start, &time->ends[i]);
+        if (real > last)
+            last = real;
+        if (!bare)
+            print_usage(time->names[i] ? time->names[i] : "-", real,
+                        &time->usage[i]);
+        timeradd(&total.ru_utime, &time->usage[i].ru_utime, &total.ru_utime);
+        timeradd(&total.ru_stime, &time->usage[i].ru_stime, &total.ru_stime);
+        if (time->usage[i].ru_maxrss > total.ru_maxrss)
+            total.ru_maxrss = time->usage[i].ru_maxrss;
+        total.ru_nvcsw += time->usage[i].ru_nvcsw;
+        total.ru_nivcsw += time->usage[i].ru_nivcsw;
+        total.ru_minflt += time->usage[i].ru_minflt;
+        total.ru_majflt += time->usage[i].ru_majflt;
+    }
+    if (job->n > 1 || bare)
+        print_usage("total", last, &total);
+}
+
+static void update_state(job_t *job)
+{
+    int running, stopped;
+
+    running = 0;
+    stopped = 0;
+    for (int i = 0; i < job->n; i++)
+    {
+        if (job->pids[i] <= 0)
+            continue;
+        if (WIFSTOPPED(job->statuses[i]))
+            stopped++;
+        else
+            running++;
+    }
+    if (running)
+        job->state = JOB_RUNNING;
+    else
+        job->state = stopped ? JOB_STOPPED : JOB_DONE;
+}
+
+static void record(job_t *job, int i, int status, struct rusage *ru)
+{
+    char    detail[64];
+
+    job->statuses[i] = WIFCONTINUED(status) ? 0 : status;
+    if (WIFEXITED(status) || WIFSIGNALED(status))
+    {
+        snprintf(detail, sizeof(detail), "pid %d, status %d",
+                 (int)job->pids[i], status_code(status));
+        trace_instant("reaped", detail);
+        job->pids[i] = 0;
+        job_usage(job, i, ru);
+    }
+}
+
+/* Waits until every stage of the job has either exited or stopped. A stage
+ * started before the terminal was handed over can get SIGTTIN (or SIGTTOU)
+ * for touching it too early, so a foreground job is just continued then. */
+void    job_wait(job_t *job)
+{
+    struct rusage   ru;
+    int             status;
+    pid_t           pid;
+    long long       start;
+
+    start = trace_now();
+    update_state(job);
+    while (job->state == JOB_RUNNING)
+    {
+        for (int i = 0; i < job->n; i++)
+        {
+            if (job->pids[i] <= 0 || WIFSTOPPED(job->statuses[i]))
+                continue;
+            pid = wait4(job->pids[i], &status,
+                        WUNTRACED | (job->tick ? WNOHANG : 0), &ru);
+            if (pid == -1 && errno == ECHILD)
+                job->pids[i] = 0;
+            if (pid <= 0)
+                continue;
+            if (job->foreground && job_control && WIFSTOPPED(status)
+                && (WSTOPSIG(status) == SIGTTIN || WSTOPSIG(status) == SIGTTOU))
+            {
+                kill(pid, SIGCONT);
+                continue;
+            }
+            record(job, i, status, &ru);
+        }
+        update_state(job);
+        if (job->tick && job->state == JOB_RUNNING)
+        {
+            job->tick(job);
+            usleep(job->tick_ms * 1000);
+        }
+    }
+    trace_span("wait", start, job->text);
+}
+
+/* Gives the job the terminal (continuing it if cont) and waits for it */
+void    job_foreground(job_t *job, int cont)
+{
+    job->foreground = 1;
+    if (job_control && job->pgid)
+    {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+        if (cont)
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &job->tmodes);
+    }
+    if (cont)
+    {
+        for (int i = 0; i < job->n; i++)
+        {
+            if (job->pids[i] > 0)
+                job->statuses[i] = 0;
+        }
+        if (job->pgid)
+            kill(-job->pgid, SIGCONT);
+        for (int i = 0; !job->pgid && i < job->n; i++)
+        {
+            if (job->pids[i] > 0)
+                kill(job->pids[i], SIGCONT);
+        }
+    }
+    job_wait(job);
+    if (job_control && job->pgid)
+    {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        /* keep what e.g. stty did, but not what a stopped or killed job
+         * left behind */
+        if (job->state == JOB_DONE && !WIFSIGNALED(job->statuses[job->n - 1]))
+            tcgetattr(STDIN_FILENO, &shell_tmodes);
+        else
+        {
+            tcgetattr(STDIN_FILENO, &job->tmodes);
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+        }
+    }
+    job->foreground = 0;
+}
+
+static void table_remove(job_t *job)
+{
+    for (job_t **p = &table; *p; p = &(*p)->next)
+    {
+        if (*p == job)
+        {
+            *p = job->next;
+            break;
+        }
+    }
+    job->next = NULL;
+}
+
+/* The last job of the table is the current one (%+) */
+static void table_append(job_t *job)
+{
+    job_t   **p;
+    int     id;
+
+    table_remove(job);
+    id = 0;
+    for (p = &table; *p; p = &(*p)->next)
+    {
+        if ((*p)->id > id)
+            id = (*p)->id;
+    }
+    if (!job->id)
+        job->id = id + 1;
+    *p = job;
+}
+
+static char mark(job_t *job)
+{
+    if (!job->next)
+        return '+';
+    if (!job->next->next)
+        return '-';
+    return ' ';
+}
+
+static void print_job(FILE *fp, job_t *job)
+{
+    char    state[32];
+    int     status;
+
+    status = job->statuses[job->n - 1];
+    for (int i = 0; job->state == JOB_STOPPED && i < job->n; i++)
+    {
+        if (job->pids[i] > 0)
+            status = job->statuses[i];
+    }
+    if (job->state == JOB_RUNNING)
+        strcpy(state, "Running");
+    else if (job->state == JOB_STOPPED)
+        snprintf(state, sizeof(state), "%s", strsignal(WSTOPSIG(status)));
+    else if (WIFSIGNALED(status))
+        snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(status)));
+    else if (WEXITSTATUS(status))
+        snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(status));
+    else
+        strcpy(state, "Done");
+    fprintf(fp, "[%d]%c  %-24s%s%s\n", job->id, mark(job), state, job->text,
+            (job->state == JOB_RUNNING) ? " &" : "");
+}
+
+/* Called once a foreground job is no longer running. A stopped job goes to
+ * the table, otherwise its status becomes the shell's (and a timed job
+ * reports its resource use). */
+void    job_finish(job_t *job)
+{
+    int     sig;
+
+    if (job->state == JOB_STOPPED)
+    {
+        table_append(job);
+        fputc('\n', stderr);
+        print_job(stderr, job);
+        sig = SIGTSTP;
+        for (int i = 0; i < job->n; i++)
+        {
+            if (job->pids[i] > 0)
+                sig = WSTOPSIG(job->statuses[i]);
+        }
+        gstate.exitstatus = EXITCODE(sig + 128);
+        return;
+    }
+    if (job->time)
+        print_times(job);
+    gstate.exitstatus = job->statuses[job->n - 1];
+    table_remove(job);
+    job_free(job);
+}
+
+/* Puts a freshly launched job in the table, or continues a stopped one */
+void    job_background(job_t *job, int cont)
+{
+    pid_t   last;
+
+    job->foreground = 0;
+    if (cont)
+    {
+        for (int i = 0; i < job->n; i++)
+        {
+            if (job->pids[i] > 0)
+                job->statuses[i] = 0;
+        }
+        for (int i = 0; i < job->n; i++)
+        {
+            if (job->pids[i] > 0 && !job->pgid)
+                kill(job->pids[i], SIGCONT);
+        }
+        if (job->pgid)
+            kill(-job->pgid, SIGCONT);
+        job->state = JOB_RUNNING;
+        printf("[%d]%c %s &\n", job->id, mark(job), job->text);
+        gstate.exitstatus = EXITCODE(EXIT_SUCCESS);
+        return;
+    }
+    table_append(job);
+    last = 0;
+    for (int i = 0; i < job->n; i++)
+    {
+        if (job->pids[i] > 0)
+            last = job->pids[i];
+    }
+    if (job_control)
+        fprintf(stderr, "[%d] %d\n", job->id, (int)last);
+    gstate.exitstatus = EXITCODE(EXIT_SUCCESS);
+}
+
+/* Reaps whatever changed in the background since the last call without
+ * blocking, and reports finished (and newly stopped) jobs if notify. */
+void    jobs_poll(int notify)
+{
+    struct signalfd_siginfo info;
+    struct rusage           ru;
+    job_t                   *job, *next;
+    jobstate_t              before;
+    int                     status, got;
+    pid_t                   pid;
+
+    got = (sigchld_fd == -1) || sigchld_pending;
+    sigchld_pending = 0;
+    while (sigchld_fd != -1
+           && read(sigchld_fd, &info, sizeof(info)) == sizeof(info))
+        got = 1;
+    if (!got)
+        return;
+    for (job = table; job; job = next)
+    {
+        next = job->next;
+        before = job->state;
+        for (int i = 0; i < job->n; i++)
+        {
+            if (job->pids[i] <= 0)
+                continue;
+            pid = wait4(job->pids[i], &status,
+                        WNOHANG | WUNTRACED | WCONTINUED, &ru);
+            if (pid == -1 && errno == ECHILD)
+                job->pids[i] = 0;
+            else if (pid > 0)
+                record(job, i, status, &ru);
+        }
+        update_state(job);
+        if (notify && job->state != before)
+            print_job(stderr, job);
+        if (job->state == JOB_DONE)
+        {
+            table_remove(job);
+            job_free(job);
+        }
+    }
+}
+
+/* Sleeps until some child changed state (or might have). The signal is
+ * consumed, so the next jobs_poll checks the table anyway. */
+void    jobs_wait_child(void)
+{
+    struct signalfd_siginfo info;
+    struct pollfd           pfd;
+
+    if (sigchld_fd == -1)
+    {
+        usleep(1000);
+        return;
+    }
+    pfd.fd = sigchld_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, -1) == -1)
+        return;
+    while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info))
+        sigchld_pending = 1;
+}
+
+/* spec is %n, %+, %% or %-, the pid of any of the job's processes, or NULL
+ * for the current job */
+job_t   *jobs_find(char *spec)
+{
+    job_t   *job, *prev;
+    char    *end;
+    long    n;
+
+    prev = NULL;
+    for (job = table; job && job->next; job = job->next)
+        prev = job;
+    if (!spec || !strcmp(spec, "%+") || !strcmp(spec, "%%")
+        || !strcmp(spec, "%"))
+        return job;
+    if (!strcmp(spec, "%-"))
+        return prev ? prev : job;
+    if (!isdigit(spec[*spec == '%']))
+        return NULL;
+    n = strtol(spec + (*spec == '%'), &end, 10);
+    if (*end)
+        return NULL;
+    for (job = table; job; job = job->next)
+    {
+        if (*spec == '%' && job->id == n)
+            return job;
+        for (int i = 0; *spec != '%' && i < job->n; i++)
+        {
+            if (job->pids[i] == n)
+                return job;
+        }
+    }
+    return NULL;
+}
+
+void    jobs_print(void)
+{
+    for (job_t *job = table; job; job = job->next)
+        print_job(stdout, job);
+}
+
+/* Blocks until job (every job if NULL) is done or stopped, the finished ones
+ * are dropped from the table. Returns the exit code of job. */
+int jobs_wait(job_t *job)
+{
+    job_t   *cur, *next;
+    int     code;
+
+    code = EXIT_SUCCESS;
+    for (cur = table; cur; cur = next)
+    {
+        next = cur->next;
+        if (job && cur != job)
+            continue;
+        job_wait(cur);
+        if (job)
+            code = status_code(cur->statuses[cur->n - 1]);
+        if (cur->state == JOB_DONE)
+        {
+            table_remove(cur);
+            job_free(cur);
+        }
+    }
+    return code;
+}
@@ -0,0 +1,65 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <sys/types.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "parse.h"
+
+typedef enum
+{
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+} jobstate_t;
+
+/* what the time keyword reports, for each stage of the job */
+typedef struct
+{
+    struct timespec start;          /* when the job was launched */
+    struct timespec *ends;          /* when each stage was reaped */
+    struct rusage   *usage;         /* what each stage used */
+    char            **names;        /* argv[0] of each stage, or NULL */
+} jobtime_t;
+
+typedef struct job_s
+{
+    struct job_s    *next;          /* next job in the table */
+    int             id;             /* the n of %n, 0 while not in the table */
+    pid_t           pgid;           /* process group, 0 without job control */
+    pid_t           *pids;          /* one per stage, 0 once reaped and -1
+                                       if the stage never started */
+    int             *statuses;      /* the last wait status of each stage */
+    int             n;              /* number of stages */
+    int             foreground;     /* whether the terminal belongs to it */
+    jobstate_t      state;
+    char            *text;          /* the command as jobs shows it */
+    struct termios  tmodes;         /* terminal modes when it was stopped */
+    void            (*tick)(struct job_s *); /* called while waiting */
+    int             tick_ms;        /* how often tick is called */
+    void            *arg;           /* for tick and release */
+    void            (*release)(struct job_s *); /* called by job_free */
+    jobtime_t       *time;          /* NULL unless the job is timed */
+} job_t;
+
+void    jobs_init(int);
+int     jobs_control(void);
+int     jobs_fileno(void);
+void    jobs_forked(void);
+job_t   *job_new(parsenode_t *, int, int);
+void    job_free(job_t *);
+void    job_started(job_t *, int, pid_t);
+void    job_timed(job_t *);
+void    job_usage(job_t *, int, struct rusage *);
+void    job_wait(job_t *);
+void    job_foreground(job_t *, int);
+void    job_finish(job_t *);
+void    job_background(job_t *, int);
+void    jobs_poll(int);
+void    jobs_wait_child(void);
+job_t   *jobs_find(char *);
+void    jobs_print(void);
+int     jobs_wait(job_t *);
+
+#endif
@@ -1,5 +1,4 @@
 #include <stdlib.h>
-#include <ctype.h>
 #include <string.h>
 #include <assert.h>
 #include <sys/wait.h>
@@ -8,6 +7,184 @@
 #include <stdio.h>
 #include "icshell.h"
 #include "lexer.h"
+#include "arena.h"
+#include "vars.h"
+
+/* Word and whitespace scanning, 16 or 32 bytes at a time where the target
+ * has it. Not under ASan, which cannot tell the aligned loads past the end
+ * of a string (see vec_scan) from a real overflow. */
+#if defined(__AVX2__) && !defined(__SANITIZE_ADDRESS__)
+# include <immintrin.h>
+# define LEXER_VEC
+typedef __m256i vec_t;
+# define VEC_LEN        32
+# define VEC_ALL        0xffffffffu
+# define vec_load(p)    _mm256_load_si256(p)
+# define vec_set(c)     _mm256_set1_epi8(c)
+# define vec_eq(a, b)   _mm256_cmpeq_epi8(a, b)
+# define vec_or(a, b)   _mm256_or_si256(a, b)
+# define vec_sub(a, b)  _mm256_sub_epi8(a, b)
+# define vec_subs(a, b) _mm256_subs_epu8(a, b)
+# define vec_mask(v)    ((uint32_t)_mm256_movemask_epi8(v))
+#elif defined(__SSE2__) && !defined(__SANITIZE_ADDRESS__)
+# include <emmintrin.h>
+# define LEXER_VEC
+typedef __m128i vec_t;
+# define VEC_LEN        16
+# define VEC_ALL        0xffffu
+# define vec_load(p)    _mm_load_si128(p)
+# define vec_set(c)     _mm_set1_epi8(c)
+# define vec_eq(a, b)   _mm_cmpeq_epi8(a, b)
+# define vec_or(a, b)   _mm_or_si128(a, b)
+# define vec_sub(a, b)  _mm_sub_epi8(a, b)
+# define vec_subs(a, b) _mm_subs_epu8(a, b)
+# define vec_mask(v)    ((uint32_t)_mm_movemask_epi8(v))
+#endif
+
+/* Character classes of the lexer, looked up in classes[] */
+#define CL_SPACE    (1 << 0)    /* isspace() in the C locale */
+#define CL_META     (1 << 1)    /* starts an operator or a quote */
+#define CL_STOP     (1 << 2)    /* ends an unquoted word: the above, $, NUL */
+#define CL_NAME     (1 << 3)    /* can be in a variable name */
+#define CL_NAME1    (1 << 4)    /* can start a variable name */
+#define CL_SPECIAL  (1 << 5)    /* a name on its own: $? $$ $# $@ $* */
+#define CL_GLOB     (1 << 6)    /* a pattern character if unquoted */
+#define CL_MARK     (1 << 7)    /* escaped in words, see MARK_ESC */
+
+#define SPACE   (CL_SPACE | CL_STOP)
+#define META    (CL_META | CL_STOP)
+#define DIGIT   (CL_NAME)
+#define ALPHA   (CL_NAME | CL_NAME1)
+
+static const uint8_t    classes[256] = {
+    ['\0'] = CL_STOP, ['$'] = CL_STOP | CL_SPECIAL,
+    ['#'] = CL_SPECIAL, ['@'] = CL_SPECIAL, ['*'] = CL_SPECIAL | CL_GLOB,
+    ['?'] = CL_SPECIAL | CL_GLOB, ['['] = CL_GLOB,
+    ['\001'] = CL_MARK, ['\002'] = CL_MARK, ['\003'] = CL_MARK,
+    ['\004'] = CL_MARK, ['\005'] = CL_MARK, ['\006'] = CL_MARK,
+    ['\007'] = CL_MARK,
+    ['\t'] = SPACE, ['\n'] = SPACE, ['\v'] = SPACE, ['\f'] = SPACE,
+    ['\r'] = SPACE, [' '] = SPACE,
+    ['<'] = META, ['>'] = META, ['|'] = META, ['&'] = META, [';'] = META,
+    ['\''] = META, ['"'] = META,
+    ['0'] = DIGIT, ['1'] = DIGIT, ['2'] = DIGIT, ['3'] = DIGIT, ['4'] = DIGIT,
+    ['5'] = DIGIT, ['6'] = DIGIT, ['7'] = DIGIT, ['8'] = DIGIT, ['9'] = DIGIT,
+    ['A'] = ALPHA, ['B'] = ALPHA, ['C'] = ALPHA, ['D'] = ALPHA, ['E'] = ALPHA,
+    ['F'] = ALPHA, ['G'] = ALPHA, ['H'] = ALPHA, ['I'] = ALPHA, ['J'] = ALPHA,
+    ['K'] = ALPHA, ['L'] = ALPHA, ['M'] = ALPHA, ['N'] = ALPHA, ['O'] = ALPHA,
+    ['P'] = ALPHA, ['Q'] = ALPHA, ['R'] = ALPHA, ['S'] = ALPHA, ['T'] = ALPHA,
+    ['U'] = ALPHA, ['V'] = ALPHA, ['W'] = ALPHA, ['X'] = ALPHA, ['Y'] = ALPHA,
+    ['Z'] = ALPHA,
+    ['a'] = ALPHA, ['b'] = ALPHA, ['c'] = ALPHA, ['d'] = ALPHA, ['e'] = ALPHA,
+    ['f'] = ALPHA, ['g'] = ALPHA, ['h'] = ALPHA, ['i'] = ALPHA, ['j'] = ALPHA,
+    ['k'] = ALPHA, ['l'] = ALPHA, ['m'] = ALPHA, ['n'] = ALPHA, ['o'] = ALPHA,
+    ['p'] = ALPHA, ['q'] = ALPHA, ['r'] = ALPHA, ['s'] = ALPHA, ['t'] = ALPHA,
+    ['u'] = ALPHA, ['v'] = ALPHA, ['w'] = ALPHA, ['x'] = ALPHA, ['y'] = ALPHA,
+    ['z'] = ALPHA,
+    ['_'] = ALPHA,
+};
+
+#undef SPACE
+#undef META
+#undef DIGIT
+#undef ALPHA
+
+#define CLASS(c)    (classes[(unsigned char)(c)])
+#define SCAN_SCALAR 16
+
+#ifdef LEXER_VEC
+
+/* The bytes of v that are whitespace */
+static uint32_t vec_spaces(vec_t v)
+{
+    vec_t   m;
+
+    m = vec_eq(v, vec_set(' '));
+    /* \t \n \v \f \r at once: v - '\t' <= '\r' - '\t' without sign */
+    m = vec_or(m, vec_eq(vec_subs(vec_sub(v, vec_set('\t')),
+                                  vec_set('\r' - '\t')), vec_set(0)));
+    return vec_mask(m);
+}
+
+/* The bytes of v that end an unquoted word, i.e. CL_STOP */
+static uint32_t vec_stops(vec_t v)
+{
+    vec_t   m;
+
+    /* they are all <= '>' but for '|', which rules most text out quickly */
+    m = vec_eq(vec_subs(v, vec_set('>')), vec_set(0));
+    if (!vec_mask(vec_or(m, vec_eq(v, vec_set('|')))))
+        return 0;
+    m = vec_eq(v, vec_set('\0'));
+    m = vec_or(m, vec_eq(v, vec_set('"')));
+    m = vec_or(m, vec_eq(v, vec_set('$')));
+    m = vec_or(m, vec_eq(vec_or(v, vec_set(1)), vec_set('\''))); /* & ' */
+    m = vec_or(m, vec_eq(v, vec_set(';')));
+    m = vec_or(m, vec_eq(vec_or(v, vec_set(2)), vec_set('>'))); /* < > */
+    m = vec_or(m, vec_eq(v, vec_set('|')));
+    return vec_mask(m) | vec_spaces(v);
+}
+
+/* Returns the first byte from s on that is not whitespace (in_space) or
+ * that ends a word. The loads are aligned so that they never cross into a
+ * page the string is not in, the bytes before s are shifted out. */
+static char *vec_scan(char *s, int in_space)
+{
+    vec_t       *p;
+    uint32_t    mask;
+    size_t      skew;
+
+    skew = (uintptr_t)s % VEC_LEN;
+    p = (vec_t *)(s - skew);
+    for (;;)
+    {
+        if (in_space)
+            mask = ~vec_spaces(vec_load(p)) & VEC_ALL;
+        else
+            mask = vec_stops(vec_load(p));
+        if ((mask >>= skew) != 0)
+            return (char *)p + skew + __builtin_ctz(mask);
+        skew = 0;
+        p++;
+    }
+}
+
+#endif
+
+/* the end of the unquoted word at s. Most words are short, so vectors
+ * only take over after the first SCAN_SCALAR bytes. */
+static char *scan_word(char *s)
+{
+    for (int i = 0; i < SCAN_SCALAR; i++, s++)
+    {
+        if (CLASS(*s) & CL_STOP)
+            return s;
+    }
+#ifdef LEXER_VEC
+    return vec_scan(s, 0);
+#else
+    while (!(CLASS(*s) & CL_STOP))
+        s++;
+    return s;
+#endif
+}
+
+/* the end of the whitespace at s */
+static char *scan_space(char *s)
+{
+    for (int i = 0; i < SCAN_SCALAR; i++, s++)
+    {
+        if (!(CLASS(*s) & CL_SPACE))
+            return s;
+    }
+#ifdef LEXER_VEC
+    return vec_scan(s, 1);
+#else
+    while (CLASS(*s) & CL_SPACE)
+        s++;
+    return s;
+#endif
+}
 
 static void handle_quotes(lexeme_t *lex, lextype_t type, qstate_t *qstate)
 {
@@ -33,88 +210,65 @@ static void handle_quotes(lexeme_t *lex, lextype_t type, qstate_t *qstate)
     }
 }
 
-lexeme_t    *new_lexeme(char *content, uint32_t len, lextype_t type,
-                        qstate_t *qstate)
+static void add_lexeme(lexlist_t *list, uint32_t off, uint32_t len,
+                       lextype_t type, qstate_t *qstate)
 {
     lexeme_t    *lex;
 
-    lex = calloc(1, sizeof(*lex));
-    if (!lex)
-        return (NULL);
-    lex->content = strdup(content);
-    if (!lex->content)
+    if (list->n == list->cap)
     {
-        free(lex);
-        return (NULL);
+        list->lexemes = arena_resize(list->lexemes,
+                                     sizeof(*list->lexemes) * list->cap,
+                                     sizeof(*list->lexemes) * list->cap * 2);
+        list->cap *= 2;
     }
+    lex = &list->lexemes[list->n++];
+    lex->off = off;
     lex->len = len;
     lex->type = type;
     lex->qstate = *qstate;
+    lex->quoted = 0;
     handle_quotes(lex, type, qstate);
-    return lex;
 }
 
-static lexeme_t *handle_whitespace(char *s, qstate_t *qstate)
+static lextype_t handle_symbols(char *s, uint32_t *len)
 {
-    uint32_t    i;
-    char        c;
-    lexeme_t    *cur;
-
-    for (i = 0; isspace(s[i]); i++)
-        /* DO NOTHING*/;
-    c = s[i];    /* save the character so we can put it back after*/
-    s[i] = '\0';
-    cur = new_lexeme(s, i, WHITESPACE, qstate);
-    s[i] = c;
-    return cur;
-}
-
-static lexeme_t *handle_symbols(char *s, qstate_t *qstate)
-{
-    lexeme_t    *cur;
-
-    cur = NULL;
+    *len = 1;
     switch (*s)
     {
         case '\'':
-            cur = new_lexeme("\'", 1, SQUOTE, qstate);
-            break;
+            return SQUOTE;
         case '\"':
-            cur = new_lexeme("\"", 1, DQUOTE, qstate);
-            break;
+            return DQUOTE;
+        case ';':
+            return SEMICOLON;
+    }
+    *len += (s[1] == *s);
+    switch (*s)
+    {
         case '|':
-            cur = new_lexeme("|", 1, PIPELINE, qstate);
-            break;
+            return (*len == 2) ? OR_IF : PIPELINE;
         case '>':
-            if (s[1] == '>')
-                cur = new_lexeme(">>", 2, REDIR_APP, qstate);
-            else
-                cur = new_lexeme(">", 1, REDIR_OUT, qstate);
-            break;
+            return (*len == 2) ? REDIR_APP : REDIR_OUT;
         case '<':
-            if (s[1] == '<')
-                cur = new_lexeme("<<", 2, HERE_DOC, qstate);
-            else
-                cur = new_lexeme("<", 1, REDIR_IN, qstate);
-            break;
+            return (*len == 2) ? HERE_DOC : REDIR_IN;
+        default: /* & */
+            return (*len == 2) ? AND_IF : BACKGROUND;
     }
-    return cur;
 }
 
-static lexeme_t *handle_words(char *s, qstate_t *qstate)
+static lextype_t handle_words(char *s, uint32_t *len)
 {
     lextype_t   type;
     uint32_t    i;
-    char        c;
-    lexeme_t    *cur;
 
-    if (s[0] == '$' && (isalnum(s[1]) || strchr("_?$", s[1])))
+    if (s[0] == '$' && (CLASS(s[1]) & (CL_NAME | CL_SPECIAL)))
     {
         type = ENV;
         i = 2;
-        if (isalpha(s[1]) || s[1] == '_')
+        if (CLASS(s[1]) & CL_NAME1)
         {
-            while (isalnum(s[i]) || s[i] == '_')
+            while (CLASS(s[i]) & CL_NAME)
                 ++i;
         }
     }
@@ -122,367 +276,374 @@ static lexeme_t *handle_words(char *s, qstate_t *qstate)
     {
         type = WORD;
         i = (s[0] == '$');
-        while (s[i] && !isspace(s[i]) && !strchr("><\'\"|$", s[i]))
-            ++i;
-    }
-    c = s[i];
-    s[i] = '\0';
-    cur = new_lexeme(s, i, type, qstate);
-    s[i] = c;
-    return cur;
-}
-
-
-void    list_add_tail(lexlist_t *list, lexeme_t *new)
-{
-    if (!list->head)
-        list->head = new;
-    else
-    {
-        list->tail->next = new;
-        new->prev = list->tail;
-    }
-    list->tail = new;
-}
-
-void    lexlist_free(lexlist_t *list)
-{
-    lexeme_t    *temp, *temp2;
-
-    temp = list->head;
-    while (temp)
-    {
-        free(temp->content);
-        temp2 = temp->next;
-        free(temp);
-        temp = temp2;
+        i = scan_word(s + i) - s;
     }
-    free(list);
+    *len = i;
+    return type;
 }
 
+/* Splits s into raw tokens: whitespace runs, quotes, operators, $NAMEs and
+ * the words in between. s is not modified and must outlive the list, which
+ * is in the arena. */
 lexlist_t   *lexer_create(char *s)
 {
     lexlist_t   *list;
-    lexeme_t    *cur;
+    lextype_t   type;
     qstate_t    qstate;
-
-    list = calloc(1, sizeof(*list));
-    assert(list);
+    uint32_t    off, len;
+
+    list = arena_alloc(sizeof(*list));
+    list->n = 0;
+    list->cap = LEXEMES_MIN;
+    list->lexemes = arena_alloc(sizeof(*list->lexemes) * list->cap);
+    list->line = s;
+    list->text = NULL;
     qstate = NOQUOTE;
-    while (*s)
+    for (off = 0; s[off]; off += len)
     {
-        cur = NULL;
-        if (isspace(*s))
-            cur = handle_whitespace(s, &qstate);
-        else if (strchr("><\'\"|", *s))
-            cur = handle_symbols(s, &qstate);
+        if (CLASS(s[off]) & CL_SPACE)
+        {
+            type = WHITESPACE;
+            len = scan_space(s + off) - (s + off);
+        }
+        else if (CLASS(s[off]) & CL_META)
+            type = handle_symbols(s + off, &len);
         else
-            cur = handle_words(s, &qstate);
-        list_add_tail(list, cur);
-        s += cur->len;
+            type = handle_words(s + off, &len);
+        add_lexeme(list, off, len, type, &qstate);
     }
     return list;
 }
 
-static char *getenv_withexit(char *key)
+/* The text of lex, NUL-terminated once the list is simplified */
+char    *lexeme_text(lexlist_t *list, lexeme_t *lex)
+{
+    return (list->text ? list->text : list->line) + lex->off;
+}
+
+/* The value of $key, which is written to num if it is a number */
+static char *value_of(char *key, char *num)
 {
     char    *value;
-    int     intval;
 
     if (!*key)
-    {
-        value = strdup("$");
-        assert(value);
+        return "$";
+    if ((value = vars_special(key, num)) != NULL)
         return value;
-    }
-    if (*key == '?')
+    value = vars_get(key);
+    return value ? value : "";
+}
+
+/* the word lexer_expand is building, always the newest allocation of the
+ * arena so that it grows in place */
+typedef struct
+{
+    char    *buf;
+    size_t  len;
+    size_t  cap;
+} expbuf_t;
+
+static void exp_put(expbuf_t *out, char *s, size_t len)
+{
+    size_t  cap;
+
+    if (out->len + len + 1 > out->cap)
     {
-        if (WIFEXITED(gstate.exitstatus))
-            intval = WEXITSTATUS(gstate.exitstatus);
-        else if (WIFSIGNALED(gstate.exitstatus))
-            intval = WTERMSIG(gstate.exitstatus) + 128;
-        else if (WIFSTOPPED(gstate.exitstatus))
-            intval = WSTOPSIG(gstate.exitstatus) + 128;
-        else
-            intval = gstate.exitstatus;
-        return itoa(intval);
+        cap = (out->len + len + 1) * 2;
+        out->buf = arena_resize(out->buf, out->cap, cap);
+        out->cap = cap;
     }
-    if (*key == '$')
-        return itoa((int)getpid());
-    value = getenv(key);
-    if (!value)
-        value = strdup("");
-    else
-        value = strdup(value);
-    assert(value);
-    return value;
+    memcpy(out->buf + out->len, s, len);
+    out->len += len;
 }
 
-void    lexer_env_expand(lexlist_t *lexlist)
+/* A value goes into the word with its mark-like bytes escaped */
+static void exp_put_value(expbuf_t *out, char *value)
 {
-    char        *new;
-    lexeme_t    *cur;
+    size_t  n;
 
-    cur = lexlist->head;
-    while (cur)
+    while (*value)
     {
-        if (cur->type == ENV && cur->qstate != IN_SQUOTE)
-        {
-            new = getenv_withexit(cur->content + 1); /* skip $ */
-            free(cur->content);
-            cur->content = new;
-            cur->len = strlen(cur->content);
-            cur->expanded = 1;
-            cur->type = WORD;
-        }
-        cur = cur->next;
+        n = strcspn(value, MARK_BYTES);
+        exp_put(out, value, n);
+        if (!value[n])
+            break;
+        exp_put(out, (char []){ MARK_ESC, value[n] }, 2);
+        value += n + 1;
     }
 }
 
-static int quote_cond(lexeme_t *lex)
+/* Returns word with its expansions done, or NULL if it expanded to nothing
+ * without any quotes in it, in which case the word is dropped like in bash.
+ * The result is always a new string in the arena, which still has its
+ * escapes and pattern marks (see lexer_unmark). */
+char    *lexer_expand(char *word)
 {
-    return (lex->type & (SQUOTE | DQUOTE)) && lex->qstate == NOQUOTE;
+    expbuf_t    out;
+    char        *end, *value, num[INT_STRINGLEN + 1];
+    size_t      n;
+    int         keep;
+
+    out.cap = strlen(word) + 1;
+    out.buf = arena_alloc(out.cap);
+    out.len = 0;
+    keep = 0;
+    while (*word)
+    {
+        n = strcspn(word, (char []){ EXP_BEGIN, EXP_KEEP, MARK_ESC, '\0' });
+        if (word[n] == MARK_ESC && word[n + 1])
+            n += 2;
+        if (n != 0)
+        {
+            exp_put(&out, word, n);
+            keep = 1;
+            word += n;
+            continue;
+        }
+        keep |= (*word == EXP_KEEP);
+        if ((end = strchr(word, EXP_END)) == NULL) /* never made by the lexer */
+        {
+            exp_put(&out, word, strlen(word));
+            break;
+        }
+        *end = '\0';
+        value = value_of(word + 1, num);
+        *end = EXP_END;
+        exp_put_value(&out, value);
+        word = end + 1;
+    }
+    if (!out.len && !keep)
+    {
+        arena_resize(out.buf, out.cap, 0);
+        return NULL;
+    }
+    out.buf[out.len] = '\0';
+    return out.buf;
 }
 
-static int whitespace_cond(lexeme_t *lex)
+/* Turns the marks of word back into what was typed, in place */
+void    lexer_unmark(char *word)
 {
-    return lex->type == WHITESPACE;
+    char    *dst;
+
+    for (dst = word; *word; word++)
+    {
+        if (*word == MARK_ESC && word[1])
+            *dst++ = *++word;
+        else if (*word == EXP_BEGIN || *word == EXP_KEEP)
+            *dst++ = '$';
+        else if (*word == GLOB_STAR)
+            *dst++ = '*';
+        else if (*word == GLOB_ANY)
+            *dst++ = '?';
+        else if (*word == GLOB_CLASS)
+            *dst++ = '[';
+        else if (*word != EXP_END)
+            *dst++ = *word;
+    }
+    *dst = '\0';
 }
 
-static int expanded_empty_cond(lexeme_t *lex)
+/* Where a word of the simplified list is being written to text */
+typedef struct
 {
-    return lex->expanded && !lex->len;
-}
+    lexeme_t    *lex;   /* NULL between words */
+    char        *out;   /* the end of text */
+    int         marks;  /* whether it has expansions */
+} wordbuf_t;
 
-/* merge right lexeme node into left node, assuming they're both not null and
-   sets the type of the merged node as WORD */
-static void merge_lexemes(lexeme_t *left, lexeme_t *right)
+static void word_begin(lexlist_t *list, wordbuf_t *w, lexeme_t *from)
 {
-    left->len += right->len;
-    left->content = realloc(left->content, left->len + 1);
-    assert(left->content != NULL);
-    strncat(left->content, right->content, right->len + 1);
-    left->next = right->next;
-    if (right->next)
-        right->next->prev = left;
-    left->type = WORD;
-    free(right->content);
-    free(right);
+    if (w->lex)
+        return;
+    w->lex = &list->lexemes[list->n++];
+    w->lex->off = w->out - list->text;
+    w->lex->type = WORD;
+    w->lex->qstate = from->qstate;
+    w->lex->quoted = 0;
+    w->marks = 0;
 }
 
-static void lexer_merge_adjacent_words(lexlist_t *list)
+/* a word with quotes anywhere in it survives an empty expansion */
+static void word_end(lexlist_t *list, wordbuf_t *w)
 {
-    lexeme_t *cur;
+    char    *p;
 
-    cur = list->head;
-    while (cur)
+    if (!w->lex)
+        return;
+    w->lex->len = w->out - (list->text + w->lex->off);
+    *w->out++ = '\0';
+    if (w->lex->quoted && w->marks)
     {
-        if (cur->type == WORD && cur->next && cur->next->type == WORD)
+        for (p = list->text + w->lex->off; p < w->out; p++)
         {
-            if (cur->next == list->tail)
-                list->tail = cur;
-            merge_lexemes(cur, cur->next);
+            if (*p == MARK_ESC)
+                p++;
+            else if (*p == EXP_BEGIN)
+                *p = EXP_KEEP;
         }
-        else
-            cur = cur->next;
     }
+    w->lex = NULL;
 }
 
-static void lexer_remove_lexemes(lexlist_t *list, int (*rm_cond)(lexeme_t *))
+/* Copies text to the word, escaping what looks like a mark and turning
+ * pattern characters into marks if glob */
+static void word_put(wordbuf_t *w, char *s, uint32_t len, int glob)
 {
-    lexeme_t    *cur, *temp;
+    char    c;
 
-    cur = list->head;
-    while (cur)
+    for (uint32_t i = 0; i < len; i++)
     {
-        temp = NULL;
-        if ((*rm_cond)(cur))
-        {
-            temp = cur;
-            if (cur == list->head)
-                list->head = cur->next;
-            if (cur == list->tail)
-                list->tail = cur->prev;
-            if (cur->next)
-                cur->next->prev = cur->prev;
-            if (cur->prev)
-                cur->prev->next = cur->next;
-            free(cur->content);
-        }
-        cur = cur->next;
-        free(temp);
+        c = s[i];
+        if (CLASS(c) & CL_MARK)
+            *w->out++ = MARK_ESC;
+        else if (glob && (CLASS(c) & CL_GLOB))
+            c = (c == '*') ? GLOB_STAR : (c == '?') ? GLOB_ANY : GLOB_CLASS;
+        *w->out++ = c;
     }
 }
 
-/* j is the 2nd quote in pair of adjacent (empty) quotes */
-static void handle_empty(lexeme_t *j)
+/* Appends a piece of a word. $NAME outside single quotes is marked for
+ * expansion when the command runs (see EXP_BEGIN), and so are unquoted
+ * pattern characters (see GLOB_STAR). */
+static void word_add(wordbuf_t *w, lexeme_t *lex, char *s)
 {
-    lexeme_t    *new;
-    qstate_t    state;
-
-    if (j->type == SQUOTE)
-        state = IN_SQUOTE;
-    else
-        state = IN_DQUOTE;
-    /* insert an empty string node between the quotes */
-    new = new_lexeme("", 0, WORD, &state);
-    new->next = j;
-    new->prev = j->prev;
-    if (j->prev)
-        j->prev->next = new;
-    j->prev = new;
+    if (lex->type == ENV && lex->qstate != IN_SQUOTE)
+    {
+        *w->out++ = EXP_BEGIN;
+        memcpy(w->out, s + 1, lex->len - 1); /* skip $ */
+        w->out += lex->len - 1;
+        *w->out++ = EXP_END;
+        w->marks = 1;
+        return;
+    }
+    word_put(w, s, lex->len, lex->type == WORD && lex->qstate == NOQUOTE);
 }
 
-/* Join all lexemes inside quotes into a single WORD lexeme */
-/* Also check here that all quotes are closed */
-static int lexer_merge_quotes(lexlist_t *list)
+/* Turns the raw tokens into words and operators in a single pass, in place:
+ * quotes go away and glue what is inside to the text around them,
+ * unquoted whitespace separates words and is dropped. Words go to a text
+ * buffer, which is at most three times as long as the line (e.g. "\001|"
+ * becomes MARK_ESC "\001\0|\0") and shrunk to fit afterwards. Returns
+ * EXIT_FAILURE if a quote is left open. */
+int     lexer_simplify(lexlist_t *list)
 {
-    lexeme_t    *i, *j;
+    wordbuf_t   w;
+    lexeme_t    lex;
+    uint32_t    n, size;
+    char        *s;
     int         inside;
 
-    i = list->head;
-    if (!i)
-        return EXIT_SUCCESS;
+    n = list->n;
+    size = n ? list->lexemes[n - 1].off + list->lexemes[n - 1].len : 0;
+    list->text = arena_alloc((size_t)size * 3 + 1);
+    w.lex = NULL;
+    w.out = list->text;
     inside = 0;
-    while (i->next)
+    list->n = 0; /* never catches up with i, merging only shrinks */
+    for (uint32_t i = 0; i < n; i++)
     {
-        if (i->qstate == NOQUOTE && i->type & (SQUOTE | DQUOTE))
+        lex = list->lexemes[i];
+        s = list->line + lex.off;
+        if ((lex.type & (SQUOTE | DQUOTE)) && lex.qstate == NOQUOTE)
         {
             inside = !inside;
-            if (inside)
-            {
-                j = i->next;
-                if (j->qstate != NOQUOTE)
-                    while (j->next && j->next->qstate != NOQUOTE)
-                        merge_lexemes(j, j->next);
-                else
-                    handle_empty(j);
-            }
+            word_begin(list, &w, &lex);
+            w.lex->quoted = 1;
+        }
+        else if (lex.qstate != NOQUOTE || (lex.type & (WORD | ENV)))
+        {
+            word_begin(list, &w, &lex);
+            word_add(&w, &lex, s);
+        }
+        else
+        {
+            word_end(list, &w);
+            if (lex.type == WHITESPACE)
+                continue;
+            lex.off = w.out - list->text;
+            memcpy(w.out, s, lex.len);
+            w.out += lex.len;
+            *w.out++ = '\0';
+            list->lexemes[list->n++] = lex;
         }
-        else if (i->qstate != NOQUOTE)
-            i->type = WORD;
-        i = i->next;
     }
-    if ((i->type & (SQUOTE | DQUOTE)) && i->qstate == NOQUOTE)
-        inside = !inside;
+    word_end(list, &w);
+    arena_resize(list->text, (size_t)size * 3 + 1, w.out - list->text);
     if (inside)
+    {
+        printerr("expected closing quote");
         return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 }
 
-lexlist_t   *lexer_simplify(lexlist_t *list)
+static void debug_lexeme(lexlist_t *list, lexeme_t *cur)
 {
-    lexer_env_expand(list);
-    lexer_remove_lexemes(list, &expanded_empty_cond);
-    if (lexer_merge_quotes(list))
+    switch (cur->type)
     {
-        printerr("expected closing quote");
-        lexlist_free(list);
-        return NULL;
+        case WHITESPACE:
+            fputs("WHITESPACE", stderr); break;
+        case WORD:
+            fputs("WORD      ", stderr); break;
+        case SQUOTE:
+            fputs("SQUOTE    ", stderr); break;
+        case DQUOTE:
+            fputs("DQUOTE    ", stderr); break;
+        case ENV:
+            fputs("ENV       ", stderr); break;
+        case PIPELINE:
+            fputs("PIPELINE  ", stderr); break;
+        case REDIR_IN:
+            fputs("REDIR_IN  ", stderr); break;
+        case REDIR_OUT:
+            fputs("REDIR_OUT ", stderr); break;
+        case HERE_DOC:
+            fputs("HERE_DOC  ", stderr); break;
+        case REDIR_APP:
+            fputs("REDIR_APP ", stderr); break;
+        case BACKGROUND:
+            fputs("BACKGROUND", stderr); break;
+        case SEMICOLON:
+            fputs("SEMICOLON ", stderr); break;
+        case AND_IF:
+            fputs("AND_IF    ", stderr); break;
+        case OR_IF:
+            fputs("OR_IF     ", stderr); break;
+    }
+    fprintf(stderr, " | %-20.*s |  %d  | %3d | ",
+        (int)cur->len, lexeme_text(list, cur),
+        cur->quoted,
+        cur->len);
+    switch (cur->qstate)
+    {
+        case NOQUOTE:
+            fputs("NOQUOTE\n", stderr); break;
+        case IN_DQUOTE:
+            fputs("IN_DQUOTE\n", stderr); break;
+        case IN_SQUOTE:
+            fputs("IN_SQUOTE\n", stderr); break;
     }
-    lexer_remove_lexemes(list, &quote_cond);
-    lexer_merge_adjacent_words(list);
-    lexer_remove_lexemes(list, &whitespace_cond);
-    return list;
 }
 
-
 void    debug_lexlist(lexlist_t *list)
 {
-    lexeme_t   *cur;
-
     if (!list)
         return;
-    fputs("\033[4mTYPE       | CONTENT              | EXP | LEN | QSTATE\n"
+    fputs("\033[4mTYPE       | CONTENT              | QUO | LEN | QSTATE\n"
           "\033[0m", stderr);
-    for (cur = list->head; cur; cur = cur->next)
-    {
-        switch (cur->type)
-        {
-            case WHITESPACE:
-                fputs("WHITESPACE", stderr); break;
-            case WORD:
-                fputs("WORD      ", stderr); break;
-            case SQUOTE:
-                fputs("SQUOTE    ", stderr); break;
-            case DQUOTE:
-                fputs("DQUOTE    ", stderr); break;
-            case ENV:
-                fputs("ENV       ", stderr); break;
-            case PIPELINE:
-                fputs("PIPELINE  ", stderr); break;
-            case REDIR_IN:
-                fputs("REDIR_IN  ", stderr); break;
-            case REDIR_OUT:
-                fputs("REDIR_OUT ", stderr); break;
-            case HERE_DOC:
-                fputs("HERE_DOC  ", stderr); break;
-            case REDIR_APP:
-                fputs("REDIR_APP ", stderr); break;
-        }
-        fprintf(stderr, " | %-20s |  %d  | %3d | ",
-            cur->content,
-            cur->expanded,
-            cur->len);
-        switch (cur->qstate)
-        {
-            case NOQUOTE:
-                fputs("NOQUOTE\n", stderr); break;
-            case IN_DQUOTE:
-                fputs("IN_DQUOTE\n", stderr); break;
-            case IN_SQUOTE:
-                fputs("IN_SQUOTE\n", stderr); break;
-        }
-    }
+    for (uint32_t i = 0; i < list->n; i++)
+        debug_lexeme(list, &list->lexemes[i]);
     fputs("\n", stderr);
 }
 
 void    debug_lexlist_tail(lexlist_t *list)
 {
-    lexeme_t   *cur;
-
     if (!list)
         return;
-    fputs("\033[4mTYPE       | CONTENT              | EXP | LEN | QSTATE\n"
+    fputs("\033[4mTYPE       | CONTENT              | QUO | LEN | QSTATE\n"
           "\033[0m", stderr);
-    for (cur = list->tail; cur; cur = cur->prev)
-    {
-        switch (cur->type)
-        {
-            case WHITESPACE:
-                fputs("WHITESPACE", stderr); break;
-            case WORD:
-                fputs("WORD      ", stderr); break;
-            case SQUOTE:
-                fputs("SQUOTE    ", stderr); break;
-            case DQUOTE:
-                fputs("DQUOTE    ", stderr); break;
-            case ENV:
-                fputs("ENV       ", stderr); break;
-            case PIPELINE:
-                fputs("PIPELINE  ", stderr); break;
-            case REDIR_IN:
-                fputs("REDIR_IN  ", stderr); break;
-            case REDIR_OUT:
-                fputs("REDIR_OUT ", stderr); break;
-            case HERE_DOC:
-                fputs("HERE_DOC  ", stderr); break;
-            case REDIR_APP:
-                fputs("REDIR_APP ", stderr); break;
-        }
-        fprintf(stderr, " | %-20s |  %d  | %3d | ",
-            cur->content,
-            cur->expanded,
-            cur->len);
-        switch (cur->qstate)
-        {
-            case NOQUOTE:
-                fputs("NOQUOTE\n", stderr); break;
-            case IN_DQUOTE:
-                fputs("IN_DQUOTE\n", stderr); break;
-            case IN_SQUOTE:
-                fputs("IN_SQUOTE\n", stderr); break;
-        }
-    }
+    for (uint32_t i = list->n; i-- > 0;)
+        debug_lexeme(list, &list->lexemes[i]);
     fputs("\n", stderr);
 }
@@ -14,9 +14,36 @@ typedef enum
     REDIR_IN    = (1 << 6), /* in:       <          */
     REDIR_OUT   = (1 << 7), /* out:      >          */
     HERE_DOC    = (1 << 8), /* here-doc: <<         */
-    REDIR_APP   = (1 << 9)  /* append:   >>         */
+    REDIR_APP   = (1 << 9), /* append:   >>         */
+    BACKGROUND  = (1 << 10), /* async:    &          */
+    SEMICOLON   = (1 << 11), /* sequence: ;          */
+    AND_IF      = (1 << 12), /* and:      &&         */
+    OR_IF       = (1 << 13)  /* or:       ||         */
 } lextype_t;
 
+/* Expansions happen when a command runs rather than when its line is read,
+ * so that "cd dir && echo $PWD" or "false || echo $?" see the effect of the
+ * commands before them. Until then $NAME stays in its word as EXP_BEGIN NAME
+ * EXP_END, or with EXP_KEEP if the word has quotes and must not go away
+ * when it expands to nothing. */
+#define EXP_BEGIN   '\001'
+#define EXP_KEEP    '\002'
+#define EXP_END     '\003'
+
+/* A byte of the input that looks like a mark is kept in the word after
+ * MARK_ESC, and so are those of the values $NAME expands to. lexer_unmark
+ * takes the escapes away once a word is no longer looked at for marks. */
+#define MARK_ESC    '\007'
+#define MARK_BYTES  "\001\002\003\004\005\006\007"
+
+/* Unquoted *, ? and [ are pathname patterns. The lexer marks them since a
+ * quoted one is just a character, see glob_expand. These bytes are escaped
+ * in the input too, see MARK_ESC. */
+#define GLOB_STAR   '\004'
+#define GLOB_ANY    '\005'
+#define GLOB_CLASS  '\006'
+#define GLOB_MARKS  "\004\005\006"
+
 typedef enum
 {
     NOQUOTE,
@@ -24,29 +51,36 @@ typedef enum
     IN_DQUOTE
 } qstate_t;
 
-typedef struct lexeme_s
+/* One token, 12 bytes. Its text is not copied but found at off in the
+ * line (or in the list's text once simplified), see lexeme_text. */
+typedef struct
 {
-    struct lexeme_s *next;      /* next lexer node */
-    struct lexeme_s *prev;      /* previous lexer node */
-    char            *content;   /* the actual text entered in the token */
-    lextype_t       type;       /* the type of the lexer node */
-    uint32_t        len;        /* the length of content */
-    uint8_t         expanded;   /* whether the environment variable in the
-                                   node has been expanded */
-    qstate_t        qstate;     /* the state of quotes at this lexer node */
+    uint32_t    off;        /* where the text starts */
+    uint32_t    len;        /* the length of the text */
+    uint16_t    type;       /* the lextype_t of the token */
+    uint8_t     qstate;     /* the qstate_t of quotes at this token */
+    uint8_t     quoted;     /* whether any part of the word was quoted */
 } lexeme_t;
 
+/* All tokens of a line in one array. Raw tokens are views into line. Since
+ * removing quotes and marking expansions changes words, lexer_simplify
+ * writes the text of what is left to text, each token NUL-terminated. */
 typedef struct
 {
-    lexeme_t    *head;
-    lexeme_t    *tail;
+    lexeme_t    *lexemes;
+    uint32_t    n;
+    uint32_t    cap;
+    char        *line;      /* the line that was lexed, not owned */
+    char        *text;      /* NULL until simplified */
 } lexlist_t;
 
-lexeme_t    *new_lexeme(char *, uint32_t, lextype_t, qstate_t *);
+#define LEXEMES_MIN     32  /* initial size of the array */
+
 lexlist_t   *lexer_create(char *);
-void        lexlist_free(lexlist_t *);
-lexlist_t   *lexer_simplify(lexlist_t *);
-void        lexer_env_expand(lexlist_t *);
+int         lexer_simplify(lexlist_t *);
+char        *lexeme_text(lexlist_t *, lexeme_t *);
+char        *lexer_expand(char *);
+void        lexer_unmark(char *);
 
 /* DEBUG */
 void        debug_lexlist(lexlist_t *);
@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "icshell.h"
+#include "builtins.h"
+#include "execution.h"
+#include "jobs.h"
+#include "parallel.h"
+
+typedef struct
+{
+    char    **cmd;      /* the command, {} is replaced by each argument */
+    int     ncmd;
+    char    **args;     /* after :::, NULL to read them from stdin */
+    int     group;      /* -g: print each job's output in one piece */
+    int     devnull;    /* stdin of the jobs when we read from it */
+    job_t   *job;
+} parallel_t;
+
+static int usage(void)
+{
+    printerr("parallel: usage: parallel [-j N] [-g] command [args] "
+             "[::: args]");
+    return EXIT_INVALID_BUILTIN;
+}
+
+/* -j N, -jN, -g, --group. Returns the number of slots, or -1 */
+static long parse_options(char ***argv, int *group)
+{
+    char    *end, *val;
+    long    slots;
+
+    slots = sysconf(_SC_NPROCESSORS_ONLN);
+    for (; **argv && ***argv == '-'; (*argv)++)
+    {
+        if (!strcmp(**argv, "--"))
+        {
+            (*argv)++;
+            break;
+        }
+        if (!strcmp(**argv, "-g") || !strcmp(**argv, "--group"))
+        {
+            *group = 1;
+            continue;
+        }
+        if (strncmp(**argv, "-j", 2))
+            return -1;
+        val = (**argv)[2] ? **argv + 2 : *++(*argv);
+        if (!val || !isdigit(*val))
+            return -1;
+        slots = strtol(val, &end, 10);
+        if (*end)
+            return -1;
+    }
+    return slots;
+}
+
+static char *next_arg(parallel_t *p)
+{
+    char    *line;
+    size_t  len;
+
+    if (p->args)
+        return *p->args ? strdup(*p->args++) : NULL;
+    if ((line = get_next_line()) == NULL)
+        return NULL;
+    len = strlen(line);
+    if (len && line[len - 1] == '\n')
+        line[len - 1] = '\0';
+    return line;
+}
+
+/* Every {} in a word of the command becomes arg, or arg is appended if
+ * there is none */
+static char **build_cmd(parallel_t *p, char *arg)
+{
+    char    **cmd, *word, *at;
+    size_t  len;
+    FILE    *fp;
+    int     replaced;
+
+    cmd = malloc(sizeof(*cmd) * (p->ncmd + 2));
+    assert(cmd);
+    replaced = 0;
+    for (int i = 0; i < p->ncmd; i++)
+    {
+        word = p->cmd[i];
+        if (!strstr(word, PARALLEL_ARG))
+        {
+            cmd[i] = strdup(word);
+            assert(cmd[i]);
+            continue;
+        }
+        fp = open_memstream(&cmd[i], &len);
+        assert(fp);
+        while ((at = strstr(word, PARALLEL_ARG)) != NULL)
+        {
+            fwrite(word, 1, at - word, fp);
+            fputs(arg, fp);
+            word = at + sizeof(PARALLEL_ARG) - 1;
+        }
+        fputs(word, fp);
+        fclose(fp);
+        replaced = 1;
+    }
+    cmd[p->ncmd] = replaced ? NULL : strdup(arg);
+    cmd[p->ncmd + 1] = NULL;
+    return cmd;
+}
+
+static void free_cmd(char **cmd)
+{
+    for (int i = 0; cmd[i]; i++)
+        free(cmd[i]);
+    free(cmd);
+}
+
+/* Prints what the job in slot wrote, all at once */
+static void flush_slot(slot_t *slot)
+{
+    int fds[2] = { slot->out, slot->err };
+
+    fflush(stdout);
+    for (int i = 0; i < 2; i++)
+    {
+        if (fds[i] == -1)
+            continue;
+        lseek(fds[i], 0, SEEK_SET);
+        copy_fd(fds[i], i + 1);
+        close(fds[i]);
+    }
+    slot->out = -1;
+    slot->err = -1;
+}
+
+/* Returns 0 if the job is running, otherwise its wait status */
+static int start(parallel_t *p, slot_t *slot, char *arg)
+{
+    char    **cmd;
+    int     fds[3], status;
+
+    slot->out = -1;
+    slot->err = -1;
+    if (p->group)
+    {
+        slot->out = anon_file(PARALLEL_NAME);
+        slot->err = anon_file(PARALLEL_NAME);
+    }
+    fds[0] = p->devnull;
+    fds[1] = slot->out;
+    fds[2] = slot->err;
+    cmd = build_cmd(p, arg);
+    slot->pid = execute_argv(cmd, fds, p->job, &status);
+    free_cmd(cmd);
+    if (slot->pid > 0)
+        return 0;
+    slot->pid = 0;
+    flush_slot(slot);
+    return status ? status : EXITCODE(EXIT_FAILURE);
+}
+
+/* Keeps every slot busy until the arguments run out, starting the next job
+ * as soon as any child is reaped. The children stay in the shell's process
+ * group, so ^C reaches all of them and stops the whole run. The exit code
+ * is the number of jobs that failed. */
+static int run(parallel_t *p, slot_t *slots, long nslots)
+{
+    char    *arg;
+    int     failed, running, stop, status;
+    pid_t   pid;
+
+    failed = 0;
+    stop = 0;
+    while (1)
+    {
+        running = 0;
+        for (long i = 0; i < nslots; i++)
+        {
+            if (!slots[i].pid && !stop && (arg = next_arg(p)) != NULL)
+            {
+                if ((status = start(p, &slots[i], arg)) != 0)
+                    failed++;
+                free(arg);
+            }
+            running += (slots[i].pid > 0);
+        }
+        if (!running)
+            break;
+        jobs_wait_child();
+        for (long i = 0; i < nslots; i++)
+        {
+            if (!slots[i].pid)
+                continue;
+            pid = waitpid(slots[i].pid, &status, WNOHANG | WUNTRACED);
+            if (pid <= 0)
+                continue;
+            if (WIFSTOPPED(status)) /* we cannot be suspended halfway */
+            {
+                kill(pid, SIGCONT);
+                continue;
+            }
+            slots[i].pid = 0;
+            flush_slot(&slots[i]);
+            if (status)
+                failed++;
+            if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+                stop = 1;
+        }
+    }
+    return failed;
+}
+
+int parallel_run(char **argv)
+{
+    parallel_t  p;
+    slot_t      *slots;
+    sigset_t    mask;
+    long        nslots;
+    int         failed;
+
+    p.group = 0;
+    if ((nslots = parse_options(&argv, &p.group)) < 0)
+        return usage();
+    p.cmd = argv;
+    for (p.ncmd = 0; argv[p.ncmd] && strcmp(argv[p.ncmd], PARALLEL_SEP);)
+        p.ncmd++;
+    if (!p.ncmd)
+        return usage();
+    p.args = argv[p.ncmd] ? argv + p.ncmd + 1 : NULL;
+    if (nslots == 0 && p.args) /* -j 0: one job per argument at once */
+    {
+        while (p.args[nslots])
+            nslots++;
+        nslots += !nslots;
+    }
+    else if (nslots == 0)
+        nslots = 1024;
+    slots = calloc(nslots, sizeof(*slots));
+    assert(slots);
+    p.devnull = p.args ? -1 : open("/dev/null", O_RDONLY | O_CLOEXEC);
+    p.job = job_new(NULL, 1, 1);
+    p.job->pgid = jobs_control() ? getpgrp() : 0;
+    /* a forked parallel (e.g. in a pipeline) must see SIGCHLD as well */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    failed = run(&p, slots, nslots);
+    if (!p.args)
+        get_next_line_sync();
+    if (p.devnull != -1)
+        close(p.devnull);
+    job_free(p.job);
+    free(slots);
+    return (failed < PARALLEL_MAX_FAILED) ? failed : PARALLEL_MAX_FAILED;
+}
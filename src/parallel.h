@@ -0,0 +1,21 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <sys/types.h>
+
+#define PARALLEL_SEP        ":::"
+#define PARALLEL_ARG        "{}"
+#define PARALLEL_NAME       "icsh_parallel" /* shown in /proc/<pid>/fd */
+#define PARALLEL_MAX_FAILED 101             /* like GNU parallel */
+
+/* one job slot: the child running in it and its grouped output */
+typedef struct
+{
+    pid_t   pid;        /* 0 while the slot is free */
+    int     out;        /* anonymous files for --group, otherwise -1 */
+    int     err;
+} slot_t;
+
+int     parallel_run(char **);
+
+#endif
@@ -6,44 +6,56 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <signal.h>
 #include "icshell.h"
 #include "lexer.h"
 #include "parse.h"
 #include "signals.h"
+#include "heredoc.h"
+#include "trace.h"
+#include "arena.h"
+
+#define LIST_OPS    (SEMICOLON | BACKGROUND | AND_IF | OR_IF)
+
+/* where the parser is in the lexemes */
+typedef struct
+{
+    lexlist_t   *list;
+    uint32_t    i;
+} tokens_t;
+
+/* returns the current lexeme, NULL at the end of the line */
+static lexeme_t *current(tokens_t *cur)
+{
+    if (cur->i < cur->list->n)
+        return &cur->list->lexemes[cur->i];
+    return NULL;
+}
 
 /* checks the lexeme given to be the same as the type. Returns 0 if not. */
-static int peek(lexeme_t **list, lextype_t type)
+static int peek(tokens_t *cur, lextype_t type)
 {
     lexeme_t    *lex;
 
-    lex = *list;
+    lex = current(cur);
     if (lex)
         return lex->type & type;
     return 0;
 }
 
-/* returns a pointer to the current node, and alters it to the next node */
-static lexeme_t *take(lexeme_t **list)
+/* returns the current lexeme, and moves on to the next one */
+static lexeme_t *take(tokens_t *cur)
 {
-    lexeme_t    *temp;
+    lexeme_t    *lex;
 
-    temp = *list;
-    if (!temp)
-        return NULL;
-    *list = temp->next;
-    return temp;
+    if ((lex = current(cur)) != NULL)
+        cur->i++;
+    return lex;
 }
 
-static parsenode_t *new_execnode(void)
+static char *content(tokens_t *cur, lexeme_t *lex)
 {
-    parsenode_t *new;
-
-    new = malloc(sizeof(*new));
-    assert(new);
-    new->type = EXEC;
-    new->exec = calloc(1, sizeof(*new->exec));
-    assert (new->exec);
-    return new;
+    return lex ? lexeme_text(cur->list, lex) : NULL;
 }
 
 static parsenode_t *new_redirnode(char *file, int fd, lextype_t type, int mode,
@@ -52,13 +64,10 @@ static parsenode_t *new_redirnode(char *file, int fd, lextype_t type, int mode,
     parsenode_t *new;
 
     assert(file);
-    new = malloc(sizeof(*new));
-    assert(new);
-    new->type = REDIR;
-    new->redir = malloc(sizeof(*new->redir));
-    assert(new->redir);
+    new = parsenode_new(REDIR);
     new->redir->file = file;
     new->redir->fd = fd;
+    new->redir->heredoc = -1;
     new->redir->type = type;
     new->redir->mode = mode;
     new->redir->cmd = cmd;
@@ -69,173 +78,413 @@ static parsenode_t *new_pipenode(parsenode_t *left, parsenode_t *right)
 {
     parsenode_t *new;
 
-    new = malloc(sizeof(*new));
-    assert(new);
-    new->type = PIPE;
-    new->pipe = malloc(sizeof(*new->pipe));
-    assert(new->pipe);
+    new = parsenode_new(PIPE);
     new->pipe->left = left;
     new->pipe->right = right;
     return new;
 }
 
-static void next_exec_arg(parsenode_t *cmd, lexeme_t *lexeme)
+static parsenode_t *new_asyncnode(parsenode_t *cmd)
 {
-    int argc;
+    parsenode_t *new;
 
-    while (cmd->type == REDIR)
-        cmd = cmd->redir->cmd;
-    argc = 0;
-    if (cmd->exec->argv)
+    new = parsenode_new(ASYNC);
+    new->async = cmd;
+    return new;
+}
+
+static parsenode_t *new_timenode(parsenode_t *cmd)
+{
+    parsenode_t *new;
+
+    new = parsenode_new(TIME);
+    new->timed = cmd;
+    return new;
+}
+
+static parsenode_t *new_listnode(nodetype_t type, parsenode_t *left,
+                                 parsenode_t *right)
+{
+    parsenode_t *new;
+
+    new = parsenode_new(type);
+    new->list->left = left;
+    new->list->right = right;
+    return new;
+}
+
+/* a command made of nothing at all, e.g. the left side of "| ls" */
+static int is_empty(parsenode_t *node)
+{
+    return node->type == EXEC && !node->exec->argv;
+}
+
+/* Appends word to argv, which doubles in size whenever it is full */
+static void exec_add_arg(exec_t *exec, char *word)
+{
+    size_t  cap;
+
+    if (exec->argc + 1 >= exec->cap)
     {
-        while (cmd->exec->argv[argc])
-            argc++;
+        cap = exec->cap ? exec->cap * 2 : ARGV_MIN;
+        exec->argv = arena_resize(exec->argv, sizeof(char *) * exec->cap,
+                                  sizeof(char *) * cap);
+        exec->cap = cap;
     }
-    cmd->exec->argv = realloc(cmd->exec->argv, sizeof(char *) * (argc + 2));
-    cmd->exec->argv[argc] = lexeme->content;
-    cmd->exec->argv[argc + 1] = NULL;
+    exec->argv[exec->argc++] = word;
+    exec->argv[exec->argc] = NULL;
 }
 
-static parsenode_t *parse_heredoc(char *delim, parsenode_t *scmd)
+/* The body goes to an anonymous file which is handed to the command as is,
+ * nothing ever touches the filesystem. A quoted delimiter (<<'EOF')
+ * turns expansion off, like in bash. */
+static parsenode_t *parse_heredoc(char *delim, int quoted, parsenode_t *scmd)
 {
-    int         dlen;
-    char        *line;
-    char        tmpfname[] = HEREDOC_FILENAME; /* see man mkstemp */
-    FILE        *heredoc;
-    lexlist_t   *lexline;
-
-    heredoc = fmkstemp(tmpfname); /* edits the XXXXXX to something unique */
-    if (!heredoc)
-        perror_exit("heredoc", EXIT_FAILURE);
-    handle_signals(HEREDOC_MODE);
-    dlen = strlen(delim);
-    fputs("> ", stdout);
-    line = get_next_line();
-    while (line)
+    int         fd;
+    parsenode_t *node;
+
+    if ((fd = anon_file(HEREDOC_NAME)) == -1)
+        perror_status("heredoc", EXIT_FAILURE);
+    else if (heredoc_read(fd, delim, !quoted) == -1)
     {
-        if (!strncmp(line, delim, dlen) && (!line[dlen] || line[dlen] == '\n'))
-            break;
-        else
-        {
-            lexline = lexer_create(line);
-            lexer_env_expand(lexline);
-            for (lexeme_t *cur = lexline->head; cur; cur = cur->next)
-                fputs(cur->content, heredoc);
-            lexlist_free(lexline);
-        }
-        free(line);
-        fputs("> ", stdout);
-        line = get_next_line();
+        close(fd);
+        fd = -1;
     }
-    free(line);
-    fclose(heredoc);
-    handle_signals(EXECUTING_MODE);
-    return new_redirnode(strdup(tmpfname), STDIN_FILENO, HERE_DOC,
-                         O_RDONLY, scmd);
+    if (fd == -1)
+    {
+        parsetree_close(scmd);
+        return NULL;
+    }
+    lseek(fd, 0, SEEK_SET);
+    node = new_redirnode(delim, STDIN_FILENO, HERE_DOC, O_RDONLY,
+                         scmd);
+    node->redir->heredoc = fd;
+    return node;
 }
 
 /* REDIRNODE ::= [REDIR_IN | REDIR_OUT | HERE_DOC | REDIR_APP] WORD [REDIRNODE]
  */
-static parsenode_t *parse_redir(parsenode_t *cmd, lexeme_t **cur)
+static parsenode_t *parse_redir(parsenode_t *cmd, tokens_t *cur)
 {
     lexeme_t    *redir, *next;
+    char        *word;
 
     while (peek(cur, REDIR_IN | REDIR_OUT | HERE_DOC | REDIR_APP))
     {
         redir = take(cur);
         next = take(cur);
-        if (!next || next->type != WORD || !*next->content)
-            syntax_error(next ? next->content : NULL);
+        word = content(cur, next);
+        if (!next || next->type != WORD || !*word)
+        {
+            syntax_error(word);
+            parsetree_close(cmd);
+            return NULL;
+        }
         switch (redir->type)
         {
             case REDIR_IN:
-                cmd = new_redirnode(next->content, STDIN_FILENO, REDIR_IN,
+                cmd = new_redirnode(word, STDIN_FILENO, REDIR_IN,
                                     O_RDONLY, cmd);
                 break;
             case REDIR_OUT:
-                cmd = new_redirnode(next->content, STDOUT_FILENO, REDIR_OUT,
+                cmd = new_redirnode(word, STDOUT_FILENO, REDIR_OUT,
                                     O_WRONLY | O_CREAT | O_TRUNC, cmd);
                 break;
-            case HERE_DOC:
-                cmd = parse_heredoc(next->content, cmd);
+            case HERE_DOC: /* the delimiter is never expanded */
+                lexer_unmark(word);
+                cmd = parse_heredoc(word, next->quoted, cmd);
                 break;
             case REDIR_APP:
-                cmd = new_redirnode(next->content, STDOUT_FILENO, REDIR_APP,
+                cmd = new_redirnode(word, STDOUT_FILENO, REDIR_APP,
                                     O_WRONLY | O_CREAT | O_APPEND, cmd);
                 break;
             default: /* should be impossible to end up here */
                 error_exit("unexpected type when parsing redirection",
                            EXIT_FAILURE);
         }
+        if (!cmd)
+            return NULL;
     }
     return cmd;
 }
 
 
-/* EXECNODE ::= [REDIRNODE] WORD+ [REDIRNODE] */
-static parsenode_t *parse_exec(lexeme_t **cur)
+/* EXECNODE ::= [REDIRNODE] WORD+ [REDIRNODE]
+ * The EXEC node stays at the bottom of the REDIR nodes, which are put on
+ * top of it as they come, so every word goes straight to its argv. */
+static parsenode_t *parse_exec(tokens_t *cur)
 {
-    int         argc;
     parsenode_t *cmd;
+    exec_t      *exec;
     lexeme_t    *lexeme;
 
-    cmd = new_execnode();
+    cmd = parsenode_new(EXEC);
+    exec = cmd->exec;
     cmd = parse_redir(cmd, cur);
-    argc = 0;
-    while (!peek(cur, PIPELINE))
+    while (cmd && !peek(cur, PIPELINE | LIST_OPS))
     {
         lexeme = take(cur);
         if (!lexeme)
             break;
         if (lexeme->type != WORD)
-            syntax_error(lexeme->content);
-        if (cmd->type == EXEC)
         {
-            cmd->exec->argv = realloc(cmd->exec->argv,
-                                      sizeof(char *) * (argc + 2));
-            cmd->exec->argv[argc] = lexeme->content;
-            cmd->exec->argv[argc + 1] = NULL;
+            syntax_error(content(cur, lexeme));
+            parsetree_close(cmd);
+            return NULL;
         }
-        else if (cmd->type == REDIR)
-            next_exec_arg(cmd, lexeme);
-        argc++;
+        exec_add_arg(exec, content(cur, lexeme));
         cmd = parse_redir(cmd, cur);
     }
     return cmd;
 }
 
 /* PIPENODE ::= EXECNODE | EXECNODE PIPELINE PIPENODE */
-static parsenode_t *parse_pipe(lexeme_t **cur)
+static parsenode_t *parse_pipe(tokens_t *cur)
 {
-    parsenode_t *node;
+    parsenode_t *node, *right;
+    lexeme_t    *next;
 
     node = parse_exec(cur);
-    if (peek(cur, PIPELINE))
+    if (node && peek(cur, PIPELINE))
     {
         take(cur);
-        if (!*cur || peek(cur, PIPELINE)
-            || (node->type == EXEC && !node->exec->argv))
+        if (!(next = current(cur)) || peek(cur, PIPELINE | LIST_OPS)
+            || is_empty(node))
+        {
+            syntax_error(peek(cur, LIST_OPS) ? content(cur, next) : "|");
+            parsetree_close(node);
+            return NULL;
+        }
+        right = parse_pipe(cur);
+        if (!right)
         {
-            syntax_error("|");
+            parsetree_close(node);
+            return NULL;
         }
-        node = new_pipenode(node, parse_pipe(cur));
+        node = new_pipenode(node, right);
     }
     return node;
 }
 
+/* TIMED ::= PIPENODE | "time" PIPENODE
+ * Like in bash, time is only a keyword in front of a pipeline and when it
+ * is not quoted. An empty pipeline is timed as well. */
+static parsenode_t *parse_timed(tokens_t *cur)
+{
+    parsenode_t *node;
+
+    if (!peek(cur, WORD) || current(cur)->quoted
+        || strcmp(content(cur, current(cur)), TIME_WORD))
+        return parse_pipe(cur);
+    take(cur);
+    if ((node = parse_pipe(cur)) == NULL)
+        return NULL;
+    return new_timenode(node);
+}
+
+/* ANDOR ::= TIMED | ANDOR [AND_IF | OR_IF] TIMED */
+static parsenode_t *parse_andor(tokens_t *cur)
+{
+    parsenode_t *node, *right;
+    lexeme_t    *op;
+
+    node = parse_timed(cur);
+    while (node && peek(cur, AND_IF | OR_IF))
+    {
+        op = take(cur);
+        right = NULL;
+        if (is_empty(node))
+            syntax_error(content(cur, op));
+        else if ((right = parse_timed(cur)) != NULL && is_empty(right))
+        {
+            syntax_error(content(cur, current(cur)));
+            parsetree_close(right);
+            right = NULL;
+        }
+        if (!right)
+        {
+            parsetree_close(node);
+            return NULL;
+        }
+        node = new_listnode(op->type == AND_IF ? AND : OR, node, right);
+    }
+    return node;
+}
+
+/* LIST ::= ANDOR | ANDOR [SEMICOLON | BACKGROUND] [LIST] */
+static parsenode_t *parse_list(tokens_t *cur)
+{
+    parsenode_t *node, *last, *right;
+    lexeme_t    *op;
+
+    node = parse_andor(cur);
+    last = node;
+    while (node && peek(cur, SEMICOLON | BACKGROUND))
+    {
+        op = take(cur);
+        if (is_empty(last))
+        {
+            syntax_error(content(cur, op));
+            parsetree_close(node);
+            return NULL;
+        }
+        if (op->type == BACKGROUND) /* only the last and-or goes away */
+        {
+            if (node == last)
+                node = new_asyncnode(node);
+            else
+                node->list->right = new_asyncnode(last);
+        }
+        if (!current(cur))
+            break;
+        if ((right = parse_andor(cur)) == NULL)
+        {
+            parsetree_close(node);
+            return NULL;
+        }
+        node = new_listnode(LIST, node, right);
+        last = right;
+    }
+    if (node && current(cur))
+    {
+        syntax_error(content(cur, current(cur)));
+        parsetree_close(node);
+        return NULL;
+    }
+    return node;
+}
+
+/* Returns NULL after printing the error if the syntax is invalid */
 parsenode_t *parse_create(lexlist_t *lexemes)
 {
-    lexeme_t    *cur;
+    tokens_t    cur;
+
+    cur.list = lexemes;
+    cur.i = 0;
+    return (parse_list(&cur));
+}
+
+/* Lexes and parses one line of input into the arena. *lexlist receives the
+ * lexemes, which own the strings of the tree, or NULL if the line has none.
+ * Returns NULL for an empty line or after printing a syntax error. */
+parsenode_t *parse_line(char *line, lexlist_t **lexlist)
+{
+    parsenode_t *parsetree;
+    long long   start;
+    int         status;
+
+    start = trace_now();
+    *lexlist = lexer_create(line);
+    trace_span("lexer_create", start, line);
+    start = trace_now();
+    status = lexer_simplify(*lexlist);
+    trace_span("lexer_simplify", start, NULL);
+    handle_signals(NO_MODE);
+    if (status != EXIT_SUCCESS)
+        return NULL;
+    if (!(*lexlist)->n)
+    {
+        *lexlist = NULL;
+        return NULL;
+    }
+    start = trace_now();
+    parsetree = parse_create(*lexlist);
+    trace_span("parse_create", start, NULL);
+    return parsetree;
+}
+
+/* A node and what it points to in one zeroed piece of the arena */
+parsenode_t *parsenode_new(nodetype_t type)
+{
+    parsenode_t *node;
+    size_t      size;
 
-    cur = lexemes->head;
-    return (parse_pipe(&cur));
+    switch (type)
+    {
+        case EXEC:
+            size = sizeof(exec_t);
+            break;
+        case REDIR:
+            size = sizeof(redir_t);
+            break;
+        case PIPE:
+            size = sizeof(pipe_t);
+            break;
+        case LIST:
+        case AND:
+        case OR:
+            size = sizeof(list_t);
+            break;
+        default: /* ASYNC and TIME only point to another node */
+            size = 0;
+    }
+    node = arena_alloc(sizeof(*node) + size);
+    memset(node, 0, sizeof(*node) + size);
+    node->type = type;
+    if (size)
+        node->list = (list_t *)(node + 1);
+    return node;
+}
+
+/* Closes the heredoc bodies that were never used. The memory of the tree
+ * is the arena's, the strings in it are the lexlist's. */
+void    parsetree_close(parsenode_t *node)
+{
+    if (!node)
+        return;
+    switch (node->type)
+    {
+        case EXEC:
+            break;
+        case REDIR:
+            if (node->redir->heredoc != -1)
+            {
+                close(node->redir->heredoc);
+                node->redir->heredoc = -1;
+            }
+            parsetree_close(node->redir->cmd);
+            break;
+        case PIPE:
+            parsetree_close(node->pipe->left);
+            parsetree_close(node->pipe->right);
+            break;
+        case ASYNC:
+            parsetree_close(node->async);
+            break;
+        case TIME:
+            parsetree_close(node->timed);
+            break;
+        case LIST:
+        case AND:
+        case OR:
+            parsetree_close(node->list->left);
+            parsetree_close(node->list->right);
+            break;
+    }
 }
 
 void    debug_parsetree(parsenode_t *node, int depth)
 {
     if (!node)
         return;
-    if (node->type == PIPE)
+    if (node->type == LIST || node->type == AND || node->type == OR)
+    {
+        debug_parsetree(node->list->right, depth + 4);
+        for (int i = 0; i < depth; i++)
+            fputc(' ', stderr);
+        fputs(node->type == LIST ? "LIST\n"
+                : (node->type == AND ? "AND\n" : "OR\n"), stderr);
+        debug_parsetree(node->list->left, depth + 4);
+    }
+    else if (node->type == ASYNC || node->type == TIME)
+    {
+        for (int i = 0; i < depth; i++)
+            fputc(' ', stderr);
+        fputs(node->type == ASYNC ? "ASYNC\n" : "TIME\n", stderr);
+        debug_parsetree(node->type == ASYNC ? node->async : node->timed,
+                        depth + 4);
+    }
+    else if (node->type == PIPE)
     {
         debug_parsetree(node->pipe->right, depth + 4);
         for (int i = 0; i < depth; i++)
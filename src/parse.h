@@ -3,25 +3,35 @@
 
 #include "lexer.h"
 
-/* for use with fmkstemp */
-#define HEREDOC_FILENAME    "/tmp/icsh_heredoc.XXXXXX"
+#define HEREDOC_NAME        "icsh_heredoc"  /* shown in /proc/<pid>/fd */
+#define TIME_WORD           "time"
+#define ARGV_MIN            8       /* first size of argv, doubles after */
 
 typedef enum
 {
     EXEC,
     REDIR,
     PIPE,
+    ASYNC,
+    LIST,
+    AND,
+    OR,
+    TIME,
 } nodetype_t;
 
 typedef struct parsenode_t parsenode_t;
 typedef struct exec_t      exec_t;
 typedef struct pipe_t      pipe_t;
 typedef struct redir_t     redir_t;
+typedef struct list_t      list_t;
 
-/* argv: list of executable and proceeding arguments */
+/* argv: list of executable and proceeding arguments, NULL without any */
+/* argc: how many there are, cap: room in argv, the final NULL included */
 struct exec_t
 {
     char    **argv;
+    size_t  argc;
+    size_t  cap;
 };
 
 struct pipe_t
@@ -30,14 +40,24 @@ struct pipe_t
     parsenode_t *right;
 };
 
-/* file: the file to be opened. */
+/* LIST runs left then right, AND and OR only run right if left succeeded
+ * or failed respectively */
+struct list_t
+{
+    parsenode_t *left;
+    parsenode_t *right;
+};
+
+/* file: the file to be opened (the delimiter for a heredoc). */
 /* fd: the fd to be dup2'd on (stdin or stdout) */
+/* heredoc: anonymous file holding the heredoc body, -1 if not a heredoc */
 /* mode: the flags to pass to open() */
 /* cmd: pointer to the next node. */
 struct redir_t
 {
     char        *file;
     int         fd;
+    int         heredoc;
     lextype_t   type;
     int         mode;
     parsenode_t *cmd;
@@ -51,10 +71,16 @@ struct parsenode_t
         pipe_t  *pipe;
         redir_t *redir;
         exec_t  *exec;
+        list_t  *list;
+        parsenode_t *async; /* the command to run in the background */
+        parsenode_t *timed; /* the pipeline to report the resource use of */
     };
 };
 
 parsenode_t *parse_create(lexlist_t *);
+parsenode_t *parse_line(char *, lexlist_t **);
+parsenode_t *parsenode_new(nodetype_t);
+void        parsetree_close(parsenode_t *);
 
 void        debug_parsetree(parsenode_t *, int);
 
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE     /* F_SETPIPE_SZ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/ioctl.h>
+#include "icshell.h"
+#include "pipes.h"
+#include "vars.h"
+
+static long pipe_max_size(void)
+{
+    static long max = 0;
+    FILE        *fp;
+
+    if (max)
+        return max;
+    max = 1 << 20; /* the kernel default */
+    if ((fp = fopen(PIPE_MAX_SIZE_FILE, "r")) != NULL)
+    {
+        if (fscanf(fp, "%ld", &max) != 1)
+            max = 1 << 20;
+        fclose(fp);
+    }
+    return max;
+}
+
+/* Parses ICSH_PIPE_SIZE, *size is set for PIPESZ_FIXED */
+static pipesz_mode_t parse_mode(long *size)
+{
+    char    *val, *end;
+    long    n;
+
+    val = vars_get(PIPE_SIZE_ENV);
+    if (!val || !*val)
+        return PIPESZ_DEFAULT;
+    if (!strcasecmp(val, "adaptive"))
+        return PIPESZ_ADAPTIVE;
+    if (!strcasecmp(val, "max"))
+    {
+        *size = pipe_max_size();
+        return PIPESZ_FIXED;
+    }
+    n = strtol(val, &end, 10);
+    if (*end == 'k' || *end == 'K')
+        n <<= 10;
+    else if (*end == 'm' || *end == 'M')
+        n <<= 20;
+    else if (*end)
+        return PIPESZ_DEFAULT;
+    if ((*end && end[1]) || n <= 0)
+        return PIPESZ_DEFAULT;
+    *size = (n < pipe_max_size()) ? n : pipe_max_size();
+    return PIPESZ_FIXED;
+}
+
+pipesz_mode_t pipes_mode(void)
+{
+    long    size;
+
+    return parse_mode(&size);
+}
+
+/* Called on every pipe of a pipeline right after it is created */
+void    pipes_setup(int fd)
+{
+    long    size;
+
+    /* failing is fine, e.g. over the unprivileged pipe-user-pages-soft */
+    if (parse_mode(&size) == PIPESZ_FIXED)
+        fcntl(fd, F_SETPIPE_SZ, (int)size);
+}
+
+/* Adaptive mode: a pipe that has no room left for an atomic write means
+ * the writer is (about to be) blocked, so the capacity is doubled. */
+void    pipes_sample(int fd)
+{
+    int     queued, cap;
+
+    cap = fcntl(fd, F_GETPIPE_SZ);
+    if (cap <= 0 || cap >= pipe_max_size())
+        return;
+    if (ioctl(fd, FIONREAD, &queued) == -1)
+        return;
+    if (queued > cap - PIPE_BUF)
+        fcntl(fd, F_SETPIPE_SZ, (cap * 2 < pipe_max_size())
+                                ? cap * 2 : (int)pipe_max_size());
+}
+
+/* ICSH_PIPE_STATS set to anything but 0 relays the pipes of foreground
+ * pipelines through the shell and reports on them */
+int pipes_stats(void)
+{
+    char    *val;
+
+    val = vars_get(PIPE_STATS_ENV);
+    return val && *val && strcmp(val, "0");
+}
+
+pipe_relay_t    *pipes_relay_new(int n)
+{
+    pipe_relay_t    *relay;
+
+    relay = malloc(sizeof(*relay));
+    assert(relay);
+    relay->edges = malloc(sizeof(*relay->edges) * n);
+    relay->pfds = malloc(sizeof(*relay->pfds) * n * 2);
+    assert(relay->edges && relay->pfds);
+    relay->n = 0;
+    clock_gettime(CLOCK_MONOTONIC, &relay->start);
+    relay->last = relay->start;
+    return relay;
+}
+
+/* Creates edge i as two pipes and gives the command's ends back in fds,
+ * fds[0] for the reader and fds[1] for the writer like pipe() */
+int pipes_relay_add(pipe_relay_t *relay, int i, int fds[2])
+{
+    pipe_edge_t *edge;
+    int         from[2], to[2];
+
+    if (pipe2(from, O_CLOEXEC) < 0)
+        return -1;
+    if (pipe2(to, O_CLOEXEC) < 0)
+    {
+        close(from[0]);
+        close(from[1]);
+        return -1;
+    }
+    pipes_setup(from[0]);
+    pipes_setup(to[0]);
+    fcntl(from[0], F_SETFL, O_NONBLOCK);
+    fcntl(to[1], F_SETFL, O_NONBLOCK);
+    edge = &relay->edges[i];
+    memset(edge, 0, sizeof(*edge));
+    edge->in = from[0];
+    edge->out = to[1];
+    fds[0] = to[0];
+    fds[1] = from[1];
+    relay->n = i + 1;
+    return 0;
+}
+
+static double   since(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec)
+        + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int  queued(int fd)
+{
+    int n;
+
+    if (ioctl(fd, FIONREAD, &n) == -1)
+        return 0;
+    return n;
+}
+
+static void close_edge(pipe_relay_t *relay, pipe_edge_t *edge)
+{
+    close(edge->in);
+    close(edge->out);
+    edge->in = -1;
+    edge->secs = since(&relay->start, &relay->last);
+}
+
+/* Moves whatever is there without blocking. The end of the writer's pipe
+ * is passed on as the end of the reader's, and a reader that went away
+ * makes the writer get SIGPIPE once we close its pipe as well. */
+static void move(pipe_relay_t *relay, pipe_edge_t *edge)
+{
+    ssize_t n;
+
+    while ((n = splice(edge->in, NULL, edge->out, NULL, RELAY_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0)
+        edge->bytes += n;
+    if (n == -1 && errno == EAGAIN)
+        edge->full = queued(edge->in) > 0;
+    else
+        close_edge(relay, edge);
+}
+
+/* Waits up to timeout_ms for any edge to be able to move data, charges the
+ * time waited to the edges that were backed up (what the writer sent did
+ * not fit in the reader's pipe) or whose reader had nothing left to read,
+ * and moves the data. */
+void    pipes_relay_pump(pipe_relay_t *relay, int timeout_ms)
+{
+    struct timespec now;
+    pipe_edge_t     *edge;
+    struct pollfd   *pfd;
+    double          dt;
+
+    for (int i = 0; i < relay->n; i++)
+    {
+        edge = &relay->edges[i];
+        pfd = &relay->pfds[2 * i];
+        pfd[0].fd = (edge->in == -1 || edge->full) ? -1 : edge->in;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = (edge->in == -1) ? -1 : edge->out;
+        pfd[1].events = edge->full ? POLLOUT : 0; /* POLLERR comes anyway */
+        pfd[0].revents = 0;
+        pfd[1].revents = 0;
+    }
+    poll(relay->pfds, relay->n * 2, timeout_ms); /* EINTR is fine too */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dt = since(&relay->last, &now);
+    relay->last = now;
+    for (int i = 0; i < relay->n; i++)
+    {
+        edge = &relay->edges[i];
+        if (edge->in == -1)
+            continue;
+        if (edge->full)
+            edge->blocked += dt;
+        if (!queued(edge->out))
+            edge->idle += dt;
+        if (relay->pfds[2 * i + 1].revents & POLLERR)
+            close_edge(relay, edge);
+        else
+            move(relay, edge);
+    }
+}
+
+/* One line per pipe, numbered by the stages it connects. The times are
+ * sampled every time the relay wakes up, so they are estimates. */
+void    pipes_relay_report(pipe_relay_t *relay, char *text)
+{
+    pipe_edge_t *edge;
+    char        name[32];
+    double      secs;
+
+    fprintf(stderr, "%s\n%-8s %14s %10s %18s %18s\n", text, "pipe", "bytes",
+            "MiB/s", "writer blocked", "reader idle");
+    for (int i = 0; i < relay->n; i++)
+    {
+        edge = &relay->edges[i];
+        secs = (edge->in == -1) ? edge->secs
+                                : since(&relay->start, &relay->last);
+        snprintf(name, sizeof(name), "%d -> %d", i + 1, i + 2);
+        fprintf(stderr, "%-8s %14lld %10.1f %10.3fs (%3.0f%%) %10.3fs "
+                "(%3.0f%%)\n", name, edge->bytes,
+                secs > 0 ? edge->bytes / secs / (1 << 20) : 0.0,
+                edge->blocked, secs > 0 ? 100 * edge->blocked / secs : 0.0,
+                edge->idle, secs > 0 ? 100 * edge->idle / secs : 0.0);
+    }
+}
+
+void    pipes_relay_free(pipe_relay_t *relay)
+{
+    for (int i = 0; i < relay->n; i++)
+    {
+        if (relay->edges[i].in != -1)
+        {
+            close(relay->edges[i].in);
+            close(relay->edges[i].out);
+        }
+    }
+    free(relay->edges);
+    free(relay->pfds);
+    free(relay);
+}
@@ -0,0 +1,52 @@
+#ifndef PIPES_H
+#define PIPES_H
+
+#include <time.h>
+#include <poll.h>
+
+#define PIPE_SIZE_ENV       "ICSH_PIPE_SIZE"
+#define PIPE_MAX_SIZE_FILE  "/proc/sys/fs/pipe-max-size"
+#define PIPE_SAMPLE_MS      5   /* how often watched pipes are looked at */
+#define PIPE_STATS_ENV      "ICSH_PIPE_STATS"
+#define RELAY_CHUNK         (1 << 20) /* most bytes per splice */
+
+typedef enum
+{
+    PIPESZ_DEFAULT,     /* leave the kernel's 64 KiB alone */
+    PIPESZ_FIXED,       /* ICSH_PIPE_SIZE=<bytes>[k|m] or max */
+    PIPESZ_ADAPTIVE     /* ICSH_PIPE_SIZE=adaptive */
+} pipesz_mode_t;
+
+/* one pipe of a relayed pipeline: the writer's pipe is spliced into the
+ * reader's by the shell, see pipes_relay_pump */
+typedef struct
+{
+    int         in;         /* read end of the writer's pipe, -1 once done */
+    int         out;        /* write end of the reader's pipe */
+    int         full;       /* in has data that did not fit in out */
+    long long   bytes;      /* moved so far */
+    double      blocked;    /* seconds the reader's pipe was full */
+    double      idle;       /* seconds the reader's pipe was empty */
+    double      secs;       /* how long the pipe was open */
+} pipe_edge_t;
+
+typedef struct
+{
+    pipe_edge_t     *edges;
+    int             n;
+    struct pollfd   *pfds;  /* two per edge */
+    struct timespec start;
+    struct timespec last;   /* when the edges were last looked at */
+} pipe_relay_t;
+
+pipesz_mode_t   pipes_mode(void);
+int             pipes_stats(void);
+void            pipes_setup(int);
+void            pipes_sample(int);
+pipe_relay_t    *pipes_relay_new(int);
+int             pipes_relay_add(pipe_relay_t *, int, int [2]);
+void            pipes_relay_pump(pipe_relay_t *, int);
+void            pipes_relay_report(pipe_relay_t *, char *);
+void            pipes_relay_free(pipe_relay_t *);
+
+#endif
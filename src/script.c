@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "icshell.h"
+#include "script.h"
+
+static script_t *script_new(void)
+{
+    script_t    *script;
+
+    script = calloc(1, sizeof(*script));
+    assert(script);
+    script->fd = -1;
+    return script;
+}
+
+/* Returns NULL with errno set if path cannot be opened or is a directory */
+script_t    *script_open(char *path)
+{
+    script_t    *script;
+    struct stat st;
+    int         fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return NULL;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        close(fd);
+        errno = EISDIR;
+        return NULL;
+    }
+    script = script_new();
+    script->cap = SCRIPT_CHUNK;
+    /* the file, the byte fill() keeps and room for the read that sees EOF */
+    if (S_ISREG(st.st_mode) && (size_t)st.st_size + 2 > script->cap)
+        script->cap = st.st_size + 2;
+    script->buf = malloc(script->cap);
+    assert(script->buf);
+    script->fd = fd;
+    return script;
+}
+
+/* The -c string, whose lines are cut in place as well */
+script_t    *script_string(char *s)
+{
+    script_t    *script;
+
+    script = script_new();
+    script->buf = s;
+    script->size = strlen(s);
+    return script;
+}
+
+/* Reads until buf holds a newline after pos or the input ends. What was
+ * already handed out is dropped to make room, buf only grows for a line
+ * longer than it. */
+static void fill(script_t *script)
+{
+    ssize_t n;
+
+    while (script->fd != -1
+           && !memchr(script->buf + script->pos, '\n',
+                      script->size - script->pos))
+    {
+        memmove(script->buf, script->buf + script->pos,
+                script->size - script->pos);
+        script->size -= script->pos;
+        script->pos = 0;
+        if (script->size + 1 >= script->cap)
+        {
+            script->cap *= 2;
+            script->buf = realloc(script->buf, script->cap);
+            assert(script->buf);
+        }
+        n = read(script->fd, script->buf + script->size,
+                 script->cap - script->size - 1);
+        if (n <= 0) /* EOF, or an error that we treat the same */
+        {
+            close(script->fd);
+            script->fd = -1;
+        }
+        else
+            script->size += n;
+    }
+}
+
+/* Returns the next line without its newline, NULL at the end. The line is
+ * valid until the next call. Lines of any length come out whole. */
+char    *script_next_line(script_t *script)
+{
+    char    *line, *nl;
+    size_t  left;
+
+    if (script->cap)
+        fill(script);
+    if (script->pos >= script->size)
+        return NULL;
+    line = script->buf + script->pos;
+    left = script->size - script->pos;
+    if ((nl = memchr(line, '\n', left)) != NULL)
+    {
+        *nl = '\0';
+        script->pos += nl - line + 1;
+        return line;
+    }
+    script->pos = script->size;
+    if (script->cap) /* fill() kept a byte for this */
+        line[left] = '\0';
+    return line;
+}
+
+void    script_close(script_t *script)
+{
+    if (script->cap)
+    {
+        if (script->fd != -1)
+            close(script->fd);
+        free(script->buf);
+    }
+    free(script);
+}
@@ -0,0 +1,26 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stddef.h>
+
+#define SCRIPT_CHUNK    (64 * 1024)     /* first read size, grows as needed */
+
+/* A script being run line by line, read into buf in chunks. A regular file
+ * gets a buf as big as itself so that it comes in with a single read. It is
+ * not mapped: a script truncated while it runs would raise SIGBUS, where a
+ * read just stops early. The lines handed out point into buf. */
+typedef struct
+{
+    char    *buf;
+    size_t  size;       /* bytes of the script in buf */
+    size_t  pos;        /* where the next line starts */
+    size_t  cap;        /* allocated size of buf, 0 when given */
+    int     fd;         /* -1 once everything is in buf */
+} script_t;
+
+script_t    *script_open(char *);
+script_t    *script_string(char *);
+char        *script_next_line(script_t *);
+void        script_close(script_t *);
+
+#endif
@@ -13,11 +13,13 @@
 
 void    signals_check_exit(int status, int nl)
 {
-    /* Don't print "Interrupt" for SIGINT */
+    /* Don't print "Interrupt" for SIGINT, nor "Broken pipe" like bash */
     if (WIFSTOPPED(status))
         custom_puts(strsignal(WSTOPSIG(status)), STDERR_FILENO);
     else if (WIFSIGNALED(status))
     {
+        if (WTERMSIG(status) == SIGPIPE)
+            return;
         if (WTERMSIG(status) != SIGINT)
             custom_puts(strsignal(WTERMSIG(status)), STDERR_FILENO);
     }
@@ -27,13 +29,14 @@ void    signals_check_exit(int status, int nl)
         fputc('\n', stderr);
 }
 
+/* The heredoc is read by the shell itself, so we cannot exit here. Without
+ * SA_RESTART the pending read fails with EINTR and the parser gives up. */
 static void signal_heredoc_cb(int signum)
 {
     if (signum == SIGINT)
     {
-        close(STDIN_FILENO);
         write(STDERR_FILENO, "^C\n", 3);
-        exit(SIGINT + 128);
+        gstate.interrupted = 1;
     }
 }
 
@@ -49,14 +52,6 @@ static void signal_default_cb(int signum)
         gstate.exitstatus = SIGINT;
 }
 
-static void signal_pipe_cb(int signum)
-{
-    close(STDIN_FILENO);
-    if (signum == SIGQUIT)
-        custom_puts("Quit", STDERR_FILENO);
-    write(STDERR_FILENO, "\n", 1);
-}
-
 /* For some reason, SIG_IGN does not properly block the SIGPIPE
  * signal from being sent to the process, so we use this function.
  * Also, this sets the exit status to 141 (SIGPIPE + 128), which is
@@ -107,12 +102,18 @@ void    handle_signals(signal_mode_t mode)
             setup_sigaction(&sa_int,  SIGINT,  &signal_heredoc_cb);
             setup_sigaction(&sa_quit, SIGQUIT, SIG_IGN);
             break;
-        case INPIPE_MODE:
-            termattr.c_lflag |= ECHOCTL;
-            setup_sigaction(&sa_int, SIGINT, &signal_pipe_cb);
-            setup_sigaction(&sa_quit, SIGQUIT, &signal_pipe_cb);
+        case CHILD_MODE: /* what an exec'd command would get */
+            /* SIGCHLD stays blocked: a forked copy of the shell still
+             * reads it from the signalfd, and posix_spawn gives the
+             * commands it starts an empty mask anyway */
+            setup_sigaction(&sa_int,  SIGINT,  SIG_DFL);
+            setup_sigaction(&sa_quit, SIGQUIT, SIG_DFL);
+            setup_sigaction(&sa_pipe, SIGPIPE, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
             break;
     }
-    if (!ret)
+    if (!ret && mode != CHILD_MODE)
         tcsetattr(STDOUT_FILENO, TCSANOW, &termattr);
 }
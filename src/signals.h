@@ -7,7 +7,7 @@ typedef enum
     INTERACTIVE_MODE,
     EXECUTING_MODE,
     HEREDOC_MODE,
-    INPIPE_MODE,
+    CHILD_MODE,
 } signal_mode_t;
 
 void    signals_check_exit(int, int);
@@ -0,0 +1,484 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "icshell.h"
+#include "lexer.h"
+#include "parse.h"
+#include "execution.h"
+#include "builtins.h"
+#include "script.h"
+#include "source.h"
+#include "arena.h"
+#include "vars.h"
+
+/* where a cache file is read from, decoding stops for good at the first
+ * thing that does not fit */
+typedef struct
+{
+    char    *p;
+    char    *end;
+    int     bad;
+} cursor_t;
+
+/* --- encoding: one node after the other, depth first --- */
+
+static void encode_u32(FILE *fp, uint32_t n)
+{
+    fwrite(&n, sizeof(n), 1, fp);
+}
+
+static void encode_str(FILE *fp, char *s)
+{
+    uint32_t    len;
+
+    len = strlen(s);
+    encode_u32(fp, len);
+    fwrite(s, 1, len + 1, fp);
+}
+
+static void encode_node(FILE *fp, parsenode_t *node)
+{
+    fputc(node->type, fp);
+    switch (node->type)
+    {
+        case EXEC:
+            encode_u32(fp, node->exec->argc);
+            for (size_t i = 0; i < node->exec->argc; i++)
+                encode_str(fp, node->exec->argv[i]);
+            break;
+        case REDIR:
+            encode_str(fp, node->redir->file);
+            encode_u32(fp, node->redir->fd);
+            encode_u32(fp, node->redir->type);
+            encode_u32(fp, node->redir->mode);
+            encode_node(fp, node->redir->cmd);
+            break;
+        case PIPE:
+            encode_node(fp, node->pipe->left);
+            encode_node(fp, node->pipe->right);
+            break;
+        case ASYNC:
+            encode_node(fp, node->async);
+            break;
+        case TIME:
+            encode_node(fp, node->timed);
+            break;
+        case LIST:
+        case AND:
+        case OR:
+            encode_node(fp, node->list->left);
+            encode_node(fp, node->list->right);
+            break;
+    }
+}
+
+/* a heredoc body lives in an anonymous file that a cache cannot keep */
+static int  cacheable(parsenode_t *node)
+{
+    switch (node->type)
+    {
+        case EXEC:
+            return 1;
+        case REDIR:
+            return node->redir->type != HERE_DOC
+                && cacheable(node->redir->cmd);
+        case PIPE:
+            return cacheable(node->pipe->left) && cacheable(node->pipe->right);
+        case ASYNC:
+            return cacheable(node->async);
+        case TIME:
+            return cacheable(node->timed);
+        default:
+            return cacheable(node->list->left)
+                && cacheable(node->list->right);
+    }
+}
+
+/* --- decoding: the strings stay in the mapping, only nodes are built --- */
+
+static void *take_bytes(cursor_t *cur, size_t n)
+{
+    void    *p;
+
+    if (cur->bad || (size_t)(cur->end - cur->p) < n)
+    {
+        cur->bad = 1;
+        return NULL;
+    }
+    p = cur->p;
+    cur->p += n;
+    return p;
+}
+
+static uint32_t decode_u32(cursor_t *cur)
+{
+    uint32_t    n;
+    void        *p;
+
+    if ((p = take_bytes(cur, sizeof(n))) == NULL)
+        return 0;
+    memcpy(&n, p, sizeof(n));
+    return n;
+}
+
+static char *decode_str(cursor_t *cur)
+{
+    uint32_t    len;
+    char        *s;
+
+    len = decode_u32(cur);
+    if ((s = take_bytes(cur, (size_t)len + 1)) == NULL || s[len])
+    {
+        cur->bad = 1;
+        return NULL;
+    }
+    return s;
+}
+
+/* Builds what encode_node wrote, in the arena. Returns NULL (with cur->bad
+ * set) if the file does not make sense. */
+static parsenode_t *decode_node(cursor_t *cur)
+{
+    parsenode_t *node;
+    uint8_t     *type;
+    uint32_t    argc;
+
+    if ((type = take_bytes(cur, 1)) == NULL)
+        return NULL;
+    node = NULL;
+    switch (*type)
+    {
+        case EXEC:
+            node = parsenode_new(EXEC);
+            argc = decode_u32(cur);
+            if (!argc || argc > (size_t)(cur->end - cur->p) / 5)
+            {
+                cur->bad |= (argc != 0);
+                break;
+            }
+            node->exec->argv = arena_alloc(sizeof(char *) * (argc + 1));
+            for (uint32_t i = 0; i < argc; i++)
+                node->exec->argv[i] = decode_str(cur);
+            node->exec->argv[argc] = NULL;
+            node->exec->argc = argc;
+            node->exec->cap = argc + 1;
+            break;
+        case REDIR:
+            node = parsenode_new(REDIR);
+            node->redir->file = decode_str(cur);
+            node->redir->fd = decode_u32(cur);
+            node->redir->type = decode_u32(cur);
+            node->redir->mode = decode_u32(cur);
+            node->redir->heredoc = -1;
+            if (!cur->bad)
+                node->redir->cmd = decode_node(cur);
+            break;
+        case PIPE:
+            node = parsenode_new(PIPE);
+            node->pipe->left = decode_node(cur);
+            if (!cur->bad)
+                node->pipe->right = decode_node(cur);
+            break;
+        case ASYNC:
+            node = parsenode_new(ASYNC);
+            node->async = decode_node(cur);
+            break;
+        case TIME:
+            node = parsenode_new(TIME);
+            node->timed = decode_node(cur);
+            break;
+        case LIST:
+        case AND:
+        case OR:
+            node = parsenode_new(*type);
+            node->list->left = decode_node(cur);
+            if (!cur->bad)
+                node->list->right = decode_node(cur);
+            break;
+        default:
+            cur->bad = 1;
+    }
+    return cur->bad ? NULL : node;
+}
+
+/* --- the cache files --- */
+
+static char *default_cache_dir(void)
+{
+    char    *dir, *home, *slash;
+
+    if ((home = vars_get("HOME")) == NULL || !*home)
+        return NULL;
+    dir = malloc(strlen(home) + sizeof(SOURCE_CACHE_DIR) + 1);
+    assert(dir);
+    sprintf(dir, "%s/%s", home, SOURCE_CACHE_DIR);
+    slash = dir + strlen(home);
+    while ((slash = strchr(slash + 1, '/')) != NULL)
+    {
+        *slash = '\0';
+        mkdir(dir, 0700);
+        *slash = '/';
+    }
+    mkdir(dir, 0700);
+    return dir;
+}
+
+/* A cache is run without being parsed again, so only ours counts: owned by
+ * us and not writable by anybody else */
+static int  trusted(struct stat *st)
+{
+    return st->st_uid == geteuid() && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/* $ICSH_CACHE_DIR, or ~/.cache/icshell which is created if needed. NULL
+ * if there is no cache, or none we can trust. */
+static char *cache_dir(void)
+{
+    struct stat st;
+    char        *dir;
+
+    if ((dir = vars_get(SOURCE_CACHE_ENV)) != NULL)
+        dir = *dir ? strdup(dir) : NULL;
+    else
+        dir = default_cache_dir();
+    if (dir && (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode)
+                || !trusted(&st)))
+    {
+        free(dir);
+        dir = NULL;
+    }
+    return dir;
+}
+
+/* the cache file of the script at the absolute path, named by its FNV-1a */
+static char *cache_path(char *path)
+{
+    uint64_t    h;
+    char        *dir, *file;
+
+    if ((dir = cache_dir()) == NULL)
+        return NULL;
+    h = 14695981039346656037ull;
+    for (char *s = path; *s; s++)
+    {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ull;
+    }
+    file = malloc(strlen(dir) + 18);
+    assert(file);
+    sprintf(file, "%s/%016llx", dir, (unsigned long long)h);
+    free(dir);
+    return file;
+}
+
+static void make_header(cachehdr_t *hdr, char *path, struct stat *st)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    strcpy(hdr->magic, SOURCE_CACHE_MAGIC);
+    hdr->format = SOURCE_CACHE_FORMAT;
+    strncpy(hdr->version, ICSHELL_VERSION, sizeof(hdr->version) - 1);
+    hdr->mtime_sec = st->st_mtim.tv_sec;
+    hdr->mtime_nsec = st->st_mtim.tv_nsec;
+    hdr->size = st->st_size;
+    hdr->pathlen = strlen(path);
+}
+
+/* Maps the cache of the script and decodes it into trees[], one per line
+ * (NULL for empty lines), in the arena. Returns the number of lines, or -1
+ * on a miss. */
+static long load_cache(char *file, char *path, struct stat *st,
+                       parsenode_t ***trees, void **map, size_t *size)
+{
+    cachehdr_t  want, *hdr;
+    struct stat cst;
+    cursor_t    cur;
+    uint8_t     *tag;
+    int         fd;
+    long        n;
+
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC | O_NOFOLLOW)) == -1)
+        return -1;
+    *map = MAP_FAILED;
+    if (fstat(fd, &cst) == 0 && S_ISREG(cst.st_mode) && trusted(&cst)
+        && (size_t)cst.st_size > sizeof(want))
+    {
+        *size = cst.st_size;
+        /* private and writable: expansion marks words up in place */
+        *map = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (*map == MAP_FAILED)
+        return -1;
+    hdr = *map;
+    make_header(&want, path, st);
+    want.nlines = hdr->nlines;
+    cur.p = (char *)*map + sizeof(*hdr);
+    cur.end = (char *)*map + *size;
+    cur.bad = memcmp(hdr, &want, sizeof(want)) != 0
+        || hdr->pathlen >= *size - sizeof(*hdr) || hdr->nlines > *size
+        || memcmp(cur.p, path, hdr->pathlen + 1) != 0;
+    if (!cur.bad)
+        cur.p += hdr->pathlen + 1;
+    *trees = arena_alloc(sizeof(**trees) * (cur.bad ? 1 : hdr->nlines + 1));
+    for (n = 0; !cur.bad && n < hdr->nlines; n++)
+    {
+        (*trees)[n] = NULL;
+        if ((tag = take_bytes(&cur, 1)) != NULL && *tag)
+            (*trees)[n] = decode_node(&cur);
+    }
+    if (!cur.bad && cur.p == cur.end)
+        return n;
+    munmap(*map, *size);
+    return -1;
+}
+
+/* Written under a temporary name and renamed, so that nobody ever maps
+ * half a cache file */
+static void store_cache(char *file, char *path, struct stat *st,
+                        char *data, size_t len, uint32_t nlines)
+{
+    cachehdr_t  hdr;
+    char        *tmp;
+    FILE        *fp;
+    int         ok, fd;
+
+    tmp = malloc(strlen(file) + INT_STRINGLEN + 6);
+    assert(tmp);
+    sprintf(tmp, "%s.tmp%d", file, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1 || (fp = fdopen(fd, "w")) == NULL)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+            unlink(tmp);
+        }
+        free(tmp);
+        return;
+    }
+    make_header(&hdr, path, st);
+    hdr.nlines = nlines;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fwrite(path, 1, hdr.pathlen + 1, fp);
+    fwrite(data, 1, len, fp);
+    ok = !ferror(fp);
+    if (fclose(fp) == 0 && ok)
+        rename(tmp, file);
+    else
+        unlink(tmp);
+    free(tmp);
+}
+
+/* --- source --- */
+
+/* Reads, runs and encodes the script line by line. The encoded trees are
+ * stored in file unless a line had a syntax error or a heredoc, or the
+ * script did not run to its end. */
+static void run_and_cache(script_t *script, char *file, char *path,
+                          struct stat *st)
+{
+    parsenode_t     *tree;
+    lexlist_t       *lexlist;
+    arena_mark_t    mark;
+    char            *line, *data;
+    size_t          len;
+    FILE            *fp;
+    uint32_t        nlines;
+    int             ok;
+
+    fp = open_memstream(&data, &len);
+    assert(fp);
+    ok = (file != NULL);
+    nlines = 0;
+    while ((line = script_next_line(script)) != NULL
+           && !execute_interrupted())
+    {
+        mark = arena_mark();
+        tree = parse_line(line, &lexlist);
+        nlines++;
+        if (!tree) /* with lexemes it was a syntax error */
+        {
+            ok &= (lexlist == NULL);
+            fputc(0, fp);
+        }
+        else
+        {
+            if ((ok = ok && cacheable(tree)))
+            {
+                fputc(1, fp);
+                encode_node(fp, tree);
+            }
+            execute_node(tree);
+            parsetree_close(tree);
+        }
+        arena_release(mark);
+    }
+    fclose(fp);
+    if (ok && !line)
+        store_cache(file, path, st, data, len, nlines);
+    free(data);
+}
+
+/* source file / . file: runs the lines of file in this shell. A script
+ * that was read before and has not changed since (same size and mtime)
+ * is not lexed or parsed again but loaded from its cache. */
+int source_run(char **argv)
+{
+    parsenode_t     **trees;
+    struct stat     st;
+    arena_mark_t    start, mark;
+    script_t        *script;
+    char            *path, *file;
+    void            *map;
+    size_t          size;
+    long            n;
+
+    if (!*argv)
+    {
+        printerr("source: filename argument required");
+        return EXIT_INVALID_BUILTIN;
+    }
+    errno = 0;
+    if (stat(*argv, &st) == 0 && S_ISDIR(st.st_mode))
+        errno = EISDIR;
+    path = NULL;
+    if (errno == EISDIR || (path = realpath(*argv, NULL)) == NULL
+        || (script = script_open(path)) == NULL)
+    {
+        fprintf(stderr, ICSHELL_NAME": %s: %s\n", *argv, strerror(errno));
+        free(path);
+        return EXIT_FAILURE;
+    }
+    gstate.exitstatus = EXITCODE(EXIT_SUCCESS);
+    file = cache_path(path);
+    start = arena_mark();
+    if (file && (n = load_cache(file, path, &st, &trees, &map, &size)) >= 0)
+    {
+        script_close(script);
+        for (long i = 0; i < n && !execute_interrupted(); i++)
+        {
+            if (!trees[i])
+                continue;
+            mark = arena_mark(); /* what the line expands to */
+            execute_node(trees[i]);
+            arena_release(mark);
+        }
+        munmap(map, size);
+    }
+    else
+    {
+        run_and_cache(script, file, path, &st);
+        script_close(script);
+    }
+    arena_release(start);
+    free(file);
+    free(path);
+    return status_code(gstate.exitstatus);
+}
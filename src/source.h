@@ -0,0 +1,28 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stdint.h>
+
+#define SOURCE_CACHE_ENV        "ICSH_CACHE_DIR"    /* "" turns it off */
+#define SOURCE_CACHE_DIR        ".cache/icshell"    /* under $HOME */
+#define SOURCE_CACHE_MAGIC      "ICSHAST"
+#define SOURCE_CACHE_FORMAT     3
+
+/* Parsed scripts are cached on disk as this header, the absolute path of
+ * the script and then every line's tree (see encode_node). A cache file is
+ * only used if it matches the script exactly. */
+typedef struct
+{
+    char        magic[8];
+    uint32_t    format;
+    char        version[16];    /* ICSHELL_VERSION */
+    int64_t     mtime_sec;
+    int64_t     mtime_nsec;
+    int64_t     size;
+    uint32_t    pathlen;
+    uint32_t    nlines;
+} cachehdr_t;
+
+int     source_run(char **);
+
+#endif
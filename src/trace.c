@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "icshell.h"
+#include "trace.h"
+#include "vars.h"
+
+/* ICSH_TRACE=file appends Chrome trace events (the JSON array format, which
+ * may stay unterminated) to file. Every event is a single write() to an
+ * O_APPEND fd, so the forked children, which inherit it, can write to it
+ * as well without mixing up their lines. Nothing happens without it. */
+static int  trace_fd = -1;
+
+/* one event per line, dropped if it does not fit */
+static void emit(char *fmt, ...)
+{
+    char    buf[TRACE_EVENT_MAX];
+    va_list ap;
+    int     len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len < 0 || len + 2 >= (int)sizeof(buf))
+        return;
+    strcpy(buf + len, ",\n");
+    write(trace_fd, buf, len + 2);
+}
+
+void    trace_init(void)
+{
+    struct stat st;
+    char        *path;
+
+    if ((path = vars_get(TRACE_ENV)) == NULL || !*path)
+        return;
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd == -1)
+    {
+        perror_status(path, EXIT_FAILURE);
+        return;
+    }
+    if (fstat(trace_fd, &st) == 0 && st.st_size == 0)
+        write(trace_fd, "[\n", 2);
+    emit("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+         "\"args\":{\"name\":\""ICSHELL_NAME"\"}}", (int)getpid(),
+         (int)getpid());
+}
+
+/* forked builtins close every close-on-exec fd but this one */
+int trace_fileno(void)
+{
+    return trace_fd;
+}
+
+/* microseconds on CLOCK_MONOTONIC, which every process shares */
+long long   trace_now(void)
+{
+    struct timespec ts;
+
+    if (trace_fd == -1)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* JSON string contents, cut short rather than overflowing buf */
+static char *escape(char *buf, size_t size, char *s)
+{
+    size_t  n;
+
+    n = 0;
+    for (; s && *s && n + 7 < size; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            buf[n++] = '\\';
+        if ((unsigned char)*s < 0x20)
+            n += snprintf(buf + n, size - n, "\\u%04x", (unsigned char)*s);
+        else
+            buf[n++] = *s;
+    }
+    buf[n] = '\0';
+    return buf;
+}
+
+/* A complete event from start (a trace_now()) until now. detail shows up
+ * in the args of the event. */
+void    trace_span(char *name, long long start, char *detail)
+{
+    char    arg[TRACE_EVENT_MAX / 2];
+
+    if (trace_fd == -1)
+        return;
+    emit("{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,"
+         "\"tid\":%ld,\"args\":{\"detail\":\"%s\"}}", name, start,
+         trace_now() - start, (int)getpid(), (long)syscall(SYS_gettid),
+         escape(arg, sizeof(arg), detail));
+}
+
+void    trace_instant(char *name, char *detail)
+{
+    char    arg[TRACE_EVENT_MAX / 2];
+
+    if (trace_fd == -1)
+        return;
+    emit("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lld,\"pid\":%d,"
+         "\"tid\":%ld,\"args\":{\"detail\":\"%s\"}}", name, trace_now(),
+         (int)getpid(), (long)syscall(SYS_gettid),
+         escape(arg, sizeof(arg), detail));
+}
@@ -0,0 +1,13 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#define TRACE_ENV           "ICSH_TRACE"
+#define TRACE_EVENT_MAX     1024    /* longer events are dropped */
+
+void        trace_init(void);
+int         trace_fileno(void);
+long long   trace_now(void);
+void        trace_span(char *, long long, char *);
+void        trace_instant(char *, char *);
+
+#endif
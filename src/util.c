@@ -1,13 +1,19 @@
+#define _GNU_SOURCE     /* memfd_create, O_TMPFILE */
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <ncurses.h>
 #include <term.h>
 #include <string.h>
 #include "icshell.h"
 #include "builtins.h"
+#include "trace.h"
+#include "vars.h"
 
 void    debug_stringlist(char **p)
 {
@@ -43,7 +49,7 @@ void    syntax_error(char *s)
     else
         fputs("newline", stderr);
     fputs("\'\n", stderr);
-    exit(EXIT_INVALID_BUILTIN);
+    gstate.exitstatus = EXITCODE(EXIT_INVALID_BUILTIN);
 }
 
 void    perror_exit(char *s, int code)
@@ -53,36 +59,71 @@ void    perror_exit(char *s, int code)
     exit(code);
 }
 
+void    perror_status(char *s, int status)
+{
+    fputs(ICSHELL_NAME": ", stderr);
+    perror(s);
+    gstate.exitstatus = EXITCODE(status);
+}
+
 pid_t   fork_and_check(void)
 {
-    pid_t   pid;
+    pid_t       pid;
+    long long   start;
 
+    start = trace_now();
     pid = fork();
     if (pid == -1)
         perror_exit("fork", EXIT_FAILURE);
+    if (pid == 0)
+        trace_instant("forked", NULL);
+    else
+        trace_span("fork", start, NULL);
     return pid;
 }
 
-/* gets next line from stdin up to and including newline or EOF character */
+static struct
+{
+    char    buf[GNL_BUFFER_SIZE];
+    ssize_t pos;
+    ssize_t len;
+}   gnl;
+
+/* gets next line from stdin up to and including newline or EOF character.
+ * Reads in blocks; a read interrupted by a signal ends the line early. */
 char *get_next_line(void)
 {
-    char    c, *line;
-    int     len, cap;
+    char    *line, *nl;
+    size_t  len, cap, take;
 
-    line = malloc(GNL_BUFFER_SIZE);
-    assert(line);
+    line = NULL;
     len = 0;
-    cap = GNL_BUFFER_SIZE;
-    while ((c = getchar()) != EOF)
+    cap = 0;
+    while (1)
     {
-        if (len + 1 >= cap)
+        if (gnl.pos == gnl.len)
         {
-            cap *= 2;
+            gnl.pos = 0;
+            gnl.len = read(STDIN_FILENO, gnl.buf, sizeof(gnl.buf));
+            if (gnl.len <= 0) /* EOF, error or EINTR */
+            {
+                gnl.len = 0;
+                break;
+            }
+        }
+        nl = memchr(gnl.buf + gnl.pos, '\n', gnl.len - gnl.pos);
+        take = nl ? (size_t)(nl - gnl.buf - gnl.pos + 1)
+                  : (size_t)(gnl.len - gnl.pos);
+        if (len + take + 1 > cap)
+        {
+            cap = (len + take + 1) * 2;
             line = realloc(line, cap);
             assert(line);
         }
-        line[len++] = c;
-        if (c == '\n')
+        memcpy(line + len, gnl.buf + gnl.pos, take);
+        len += take;
+        gnl.pos += take;
+        if (nl)
             break;
     }
     if (len == 0)
@@ -94,24 +135,36 @@ char *get_next_line(void)
     return line;
 }
 
-/* create temporary file, see man mkstemp */
-FILE    *fmkstemp(char *template)
+/* readline reads the fd directly, so give back what we read ahead of it */
+void    get_next_line_sync(void)
+{
+    if (gnl.pos < gnl.len
+        && lseek(STDIN_FILENO, gnl.pos - gnl.len, SEEK_CUR) != -1)
+        gnl.pos = gnl.len;
+}
+
+/* Creates an anonymous file that lives only as long as its fds: a memfd,
+ * or an unnamed O_TMPFILE if the kernel has no memfd_create. */
+int     anon_file(char *name)
 {
-    FILE    *fp;
-    int     fd;
+    int fd;
 
-    fp = NULL;
-    fd = mkstemp(template);
-    if (fd >= 0)
-    {
-        fp = fdopen(fd, "w+");
-        if (!fp)
-        {
-            close(fd);
-            remove(template); /* delete the file */
-        }
-    }
-    return(fp);
+    fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd == -1)
+        fd = open(P_tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    return fd;
+}
+
+/* the value of $? for a wait status */
+int     status_code(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    else if (WIFSIGNALED(status))
+        return WTERMSIG(status) + 128;
+    else if (WIFSTOPPED(status))
+        return WSTOPSIG(status) + 128;
+    return status;
 }
 
 char    *itoa(int n)
@@ -127,21 +180,21 @@ char    *itoa(int n)
 
 static void set_shlvl(void)
 {
-    char    new[INT_STRINGLEN], *val, *endptr;
+    char    new[INT_STRINGLEN + 1], *val, *endptr;
     long    shlvl;
 
-    val = getenv("SHLVL");
+    val = vars_get("SHLVL");
     if (val)
     {
         shlvl = strtol(val, &endptr, 10);
         if (!*endptr)
         {
-            snprintf(new, sizeof(new), "%ld", shlvl + 1);
-            setenv("SHLVL", new, 1);
+            snprintf(new, sizeof(new), "%d", (int)shlvl + 1);
+            vars_set("SHLVL", new, 1);
             return;
         }
     }
-    setenv("SHLVL", "1", 1);
+    vars_set("SHLVL", "1", 1);
     return;
 }
 
@@ -159,20 +212,15 @@ static void setupterm_wrapper(char *term)
 
 void    setup_env(int argc, char **argv)
 {
-    char    *digit;
-
-    for (int i = 0; i < argc; i++)
-    {
-        digit = itoa(i);
-        setenv(digit, argv[i], 1);  /* $0, $1, ... */
-        free(digit);
-    }
+    gstate.pid = getpid();
+    vars_set_params(argc, argv);
     set_shlvl();
     set_pwd("PWD");
-    setenv("OLDPWD", "", 0);    /* don't overwrite */
-    setenv("TERM", "linux", 0); /* don't overwrite */
-    setenv("SHELL", "icshell", 1); /* overwrite */
-    setupterm_wrapper(getenv("TERM"));
+    vars_export("OLDPWD");      /* declared, but not set */
+    if (!vars_get("TERM"))
+        vars_set("TERM", "linux", 1);
+    vars_set("SHELL", "icshell", 1);
+    setupterm_wrapper(vars_get("TERM"));
 }
 
 /* required because FILE functions (e.g fputs) are buffered
@@ -191,8 +239,8 @@ char    *current_dir_prompt(void)
     char    *ret, *pwd, *home_dir;
     int     pwd_len, home_len;
 
-    pwd      = getenv("PWD");
-    home_dir = getenv("HOME");
+    pwd      = vars_get("PWD");
+    home_dir = vars_get("HOME");
     if (!pwd)
     {
         ret = strdup(ICSHELL_NAME"> ");
@@ -0,0 +1,421 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <assert.h>
+#include "icshell.h"
+#include "vars.h"
+
+/* Shell variables by name. The environment the shell was started with is
+ * imported on first use. Exported variables reach the children through
+ * envp, which is only rebuilt once one of them changed. environ points to
+ * envp as well so that libc sees the same variables, which is why entries
+ * envp might still refer to are retired instead of freed until then. */
+static var_t    **table;
+static size_t   nbuckets;
+static size_t   nvars;
+static char     **envp;
+static int      envp_dirty = 1;
+static char     **retired;
+static size_t   nretired;
+static size_t   retired_cap;
+
+/* FNV-1a */
+static unsigned int hash_name(char *name, size_t len)
+{
+    unsigned int h;
+
+    h = 2166136261u;
+    while (len--)
+    {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void table_insert(var_t *var)
+{
+    size_t  i;
+
+    i = var->hash & (nbuckets - 1);
+    var->next = table[i];
+    table[i] = var;
+}
+
+static void grow(void)
+{
+    var_t   **old, *var, *next;
+    size_t  n;
+
+    old = table;
+    n = nbuckets;
+    nbuckets = n ? n * 2 : VARS_BUCKETS_MIN;
+    table = calloc(nbuckets, sizeof(*table));
+    assert(table);
+    for (size_t i = 0; i < n; i++)
+    {
+        for (var = old[i]; var; var = next)
+        {
+            next = var->next;
+            table_insert(var);
+        }
+    }
+    free(old);
+}
+
+static var_t    *lookup(char *name, size_t len, unsigned int hash)
+{
+    var_t   *var;
+
+    for (var = table[hash & (nbuckets - 1)]; var; var = var->next)
+    {
+        if (var->hash == hash && var->namelen == len
+            && !memcmp(var->entry, name, len))
+            return var;
+    }
+    return NULL;
+}
+
+static var_t    *var_new(size_t len, unsigned int hash)
+{
+    var_t   *var;
+
+    if (nvars >= nbuckets)
+        grow();
+    var = calloc(1, sizeof(*var));
+    assert(var);
+    var->namelen = len;
+    var->hash = hash;
+    table_insert(var);
+    nvars++;
+    return var;
+}
+
+/* The first definition of a name wins, like for getenv */
+static void import_environ(void)
+{
+    var_t           *var;
+    char            *equals;
+    size_t          len;
+    unsigned int    hash;
+
+    grow();
+    for (char **env = environ; env && *env; env++)
+    {
+        if ((equals = strchr(*env, '=')) == NULL)
+            continue;
+        len = equals - *env;
+        hash = hash_name(*env, len);
+        if (lookup(*env, len, hash))
+            continue;
+        var = var_new(len, hash);
+        var->entry = strdup(*env);
+        assert(var->entry);
+        var->exported = 1;
+    }
+}
+
+static var_t    *find(char *name, size_t len, int create)
+{
+    var_t           *var;
+    unsigned int    hash;
+
+    if (!table)
+        import_environ();
+    hash = hash_name(name, len);
+    if ((var = lookup(name, len, hash)) == NULL && create)
+        var = var_new(len, hash);
+    return var;
+}
+
+static int  has_value(var_t *var)
+{
+    return var->entry && var->entry[var->namelen] == '=';
+}
+
+/* Gets rid of the entry of var, which envp may still point to. The
+ * retired entries are freed with the next envp at the latest. */
+static void drop_entry(var_t *var)
+{
+    if (!var->entry)
+        return;
+    if (var->exported && has_value(var))
+    {
+        envp_dirty = 1;
+        if (envp)
+        {
+            if (nretired == retired_cap)
+            {
+                retired_cap = retired_cap ? retired_cap * 2 : 16;
+                retired = realloc(retired, sizeof(*retired) * retired_cap);
+                assert(retired);
+            }
+            retired[nretired++] = var->entry;
+            var->entry = NULL;
+            if (nretired >= VARS_RETIRED_MAX) /* e.g. a loop of cd */
+                vars_environ();
+            return;
+        }
+    }
+    free(var->entry);
+    var->entry = NULL;
+}
+
+/* NULL if name is not set (or only declared) */
+char    *vars_get(char *name)
+{
+    var_t   *var;
+
+    var = find(name, strlen(name), 0);
+    if (!var || !has_value(var))
+        return NULL;
+    return var->entry + var->namelen + 1;
+}
+
+/* Sets name to value, exporting it as well if export. An exported variable
+ * stays exported. */
+void    vars_set(char *name, char *value, int export)
+{
+    var_t   *var;
+    char    *entry;
+    size_t  len, vlen;
+
+    len = strlen(name);
+    vlen = strlen(value);
+    var = find(name, len, 1);
+    entry = malloc(len + vlen + 2);
+    assert(entry);
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, vlen + 1);
+    drop_entry(var);
+    var->entry = entry;
+    if (export)
+        var->exported = 1;
+    if (var->exported)
+        envp_dirty = 1;
+}
+
+/* export NAME: keeps the value, or declares name without one */
+void    vars_export(char *name)
+{
+    var_t   *var;
+
+    var = find(name, strlen(name), 1);
+    if (!var->entry)
+    {
+        var->entry = strdup(name);
+        assert(var->entry);
+    }
+    if (!var->exported)
+    {
+        var->exported = 1;
+        envp_dirty |= has_value(var);
+    }
+}
+
+void    vars_unset(char *name)
+{
+    var_t   **p, *var;
+    size_t  len;
+
+    len = strlen(name);
+    if ((var = find(name, len, 0)) == NULL)
+        return;
+    for (p = &table[var->hash & (nbuckets - 1)]; *p != var; p = &(*p)->next)
+        /* DO NOTHING */;
+    *p = var->next;
+    drop_entry(var);
+    free(var);
+    nvars--;
+}
+
+/* The environment of the children: every exported variable with a value */
+char    **vars_environ(void)
+{
+    var_t   *var;
+    size_t  n;
+
+    if (!table)
+        import_environ();
+    if (!envp_dirty)
+        return envp;
+    n = 0;
+    for (size_t i = 0; i < nbuckets; i++)
+    {
+        for (var = table[i]; var; var = var->next)
+            n += var->exported && has_value(var);
+    }
+    envp = realloc(envp, sizeof(*envp) * (n + 1));
+    assert(envp);
+    n = 0;
+    for (size_t i = 0; i < nbuckets; i++)
+    {
+        for (var = table[i]; var; var = var->next)
+        {
+            if (var->exported && has_value(var))
+                envp[n++] = var->entry;
+        }
+    }
+    envp[n] = NULL;
+    environ = envp;
+    while (nretired)
+        free(retired[--nretired]);
+    envp_dirty = 0;
+    return envp;
+}
+
+static int  compare_vars(const void *p1, const void *p2)
+{
+    const var_t *v1, *v2;
+    int         cmp;
+
+    v1 = *(const var_t **)p1;
+    v2 = *(const var_t **)p2;
+    cmp = memcmp(v1->entry, v2->entry,
+                 v1->namelen < v2->namelen ? v1->namelen : v2->namelen);
+    if (cmp)
+        return cmp;
+    return (v1->namelen > v2->namelen) - (v1->namelen < v2->namelen);
+}
+
+/* export without arguments, sorted by name like bash */
+void    vars_print_exported(void)
+{
+    var_t   **sorted, *var;
+    size_t  n;
+
+    if (!table)
+        import_environ();
+    sorted = malloc(sizeof(*sorted) * (nvars + 1));
+    assert(sorted);
+    n = 0;
+    for (size_t i = 0; i < nbuckets; i++)
+    {
+        for (var = table[i]; var; var = var->next)
+        {
+            if (var->exported)
+                sorted[n++] = var;
+        }
+    }
+    qsort(sorted, n, sizeof(*sorted), &compare_vars);
+    for (size_t i = 0; i < n; i++)
+    {
+        var = sorted[i];
+        if (has_value(var))
+            printf("declare -x %.*s=\"%s\"\n", (int)var->namelen, var->entry,
+                   var->entry + var->namelen + 1);
+        else
+            printf("declare -x %s\n", var->entry);
+    }
+    free(sorted);
+}
+
+/* The positional parameters live apart from the variables, so that $1 is
+ * an index rather than a lookup and the children never see them in their
+ * environment. params[0] is $0, the rest are $1 to $#. "$*" (and "$@",
+ * since words are not split) is joined once and kept until they change. */
+static char     **params;
+static size_t   nparams;
+static char     *joined;
+
+/* $0 is argv[0], $1... the rest of argv, replacing the old ones */
+void    vars_set_params(int argc, char **argv)
+{
+    for (size_t i = 0; params && params[i]; i++)
+        free(params[i]);
+    params = realloc(params, sizeof(*params) * (argc + 1));
+    assert(params);
+    for (int i = 0; i < argc; i++)
+    {
+        params[i] = strdup(argv[i]);
+        assert(params[i]);
+    }
+    params[argc] = NULL;
+    nparams = argc ? argc - 1 : 0;
+    free(joined);
+    joined = NULL;
+}
+
+/* $n, NULL if there are fewer parameters. $0 is always there. */
+char    *vars_param(size_t n)
+{
+    if (!params || n > nparams)
+        return n ? NULL : ICSHELL_NAME;
+    return params[n];
+}
+
+size_t  vars_nparams(void)
+{
+    return nparams;
+}
+
+/* shift n: $n+1 becomes $1. Returns EXIT_FAILURE if there are fewer than n
+ * parameters, in which case nothing changes. */
+int     vars_shift(size_t n)
+{
+    if (n > nparams)
+        return EXIT_FAILURE;
+    if (!n)
+        return EXIT_SUCCESS;
+    for (size_t i = 1; i <= n; i++)
+        free(params[i]);
+    memmove(params + 1, params + 1 + n, sizeof(*params) * (nparams - n + 1));
+    nparams -= n;
+    free(joined);
+    joined = NULL;
+    return EXIT_SUCCESS;
+}
+
+static char *join_params(void)
+{
+    size_t  len;
+    char    *p;
+
+    if (joined)
+        return joined;
+    len = 1;
+    for (size_t i = 1; i <= nparams; i++)
+        len += strlen(params[i]) + 1;
+    joined = malloc(len);
+    assert(joined);
+    p = joined;
+    for (size_t i = 1; i <= nparams; i++)
+    {
+        if (i > 1)
+            *p++ = ' ';
+        p = stpcpy(p, params[i]);
+    }
+    *p = '\0';
+    return joined;
+}
+
+/* The value of a parameter that is not a variable: $?, $$, $#, $@, $*
+ * and $0 to $9, or NULL if key names a variable. Numbers are written to
+ * num, and an unset positional parameter is "". */
+char    *vars_special(char *key, char *num)
+{
+    switch (*key)
+    {
+        case '?':
+            sprintf(num, "%d", status_code(gstate.exitstatus));
+            return num;
+        case '$':
+            sprintf(num, "%d", (int)gstate.pid);
+            return num;
+        case '#':
+            sprintf(num, "%zu", nparams);
+            return num;
+        case '@':
+        case '*':
+            return join_params();
+    }
+    if (isdigit((unsigned char)*key))
+    {
+        key = vars_param(*key - '0');
+        return key ? key : "";
+    }
+    return NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef VARS_H
+#define VARS_H
+
+#include <stddef.h>
+
+#define VARS_BUCKETS_MIN    256 /* doubled whenever there are more vars */
+#define VARS_RETIRED_MAX    64  /* old entries kept before envp is rebuilt */
+
+typedef struct var_s
+{
+    struct var_s    *next;      /* next variable in the same bucket */
+    char            *entry;     /* "NAME=value", just "NAME" if declared */
+    size_t          namelen;
+    unsigned int    hash;
+    int             exported;
+} var_t;
+
+char    *vars_get(char *);
+void    vars_set(char *, char *, int);
+void    vars_export(char *);
+void    vars_unset(char *);
+char    **vars_environ(void);
+void    vars_print_exported(void);
+void    vars_set_params(int, char **);
+char    *vars_param(size_t);
+size_t  vars_nparams(void);
+int     vars_shift(size_t);
+char    *vars_special(char *, char *);
+
+#endif
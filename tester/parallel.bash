@@ -0,0 +1,42 @@
+# The parallel builtin of icshell as a bash function, for the bash side of
+# the tests (bash -c reads $BASH_ENV). It runs the jobs one at a time, so
+# only lines with -j 1 or -g have an output that both can agree on.
+parallel() {
+    local cmd=() args=() run=() word arg replaced failed=0
+
+    while [[ $1 == -* ]]; do
+        case $1 in
+            --) shift; break ;;
+            -g|--group) shift ;;
+            -j) shift 2 ;;
+            -j*) shift ;;
+            *) echo "parallel: usage: parallel [-j N] [-g] command [args] [::: args]" >&2
+               return 2 ;;
+        esac
+    done
+    while (($#)) && [[ $1 != ::: ]]; do
+        cmd+=("$1")
+        shift
+    done
+    if (($#)); then
+        shift
+        args=("$@")
+    else
+        mapfile -t args
+    fi
+    for arg in "${args[@]}"; do
+        run=()
+        replaced=0
+        for word in "${cmd[@]}"; do
+            if [[ $word == *'{}'* ]]; then
+                run+=("${word//'{}'/"$arg"}")
+                replaced=1
+            else
+                run+=("$word")
+            fi
+        done
+        ((replaced)) || run+=("$arg")
+        "${run[@]}" </dev/null || ((failed++))
+    done
+    return $failed
+}
@@ -12,13 +12,15 @@ import shutil
 SHELL_PATH = "../icshell"
 TESTS_PATH = "./tests"
 FILES_PATH = "./files"
+# icshell builtins that bash lacks, as bash functions
+BASH_ENV_PATH = os.path.abspath("./parallel.bash")
 
 def run_shell_command(command, shell_path, stdout_file, stderr_file):
     """
     Run a command using the specified shell and redirect stdout/stderr to files.
     """
     process = subprocess.Popen(
-        [shell_path, '-c', command],
+        [shell_path, command],
         stdout=subprocess.PIPE,
         stderr=subprocess.PIPE,
         text=True
@@ -53,7 +55,8 @@ def run_bash_commands_independently(test_file, stdout_file, stderr_file):
             ['bash', '-c', line],
             stdout=subprocess.PIPE,
             stderr=subprocess.PIPE,
-            text=True
+            text=True,
+            env=dict(os.environ, BASH_ENV=BASH_ENV_PATH)
         )
         try:
             stdout, stderr = process.communicate(timeout=30)